@@ -8,7 +8,7 @@ LOCAL_SRC_FILES := lights.c
 LOCAL_PRELINK_MODULE := false
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 
-LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_SHARED_LIBRARIES := liblog libcutils
 
 LOCAL_MODULE := lights.$(TARGET_DEVICE)
 LOCAL_MODULE_TAGS := optional
@@ -17,4 +17,19 @@ ifeq ($(BOARD_GRAPHIC_IS_GEN),true)
 LOCAL_CFLAGS += -DGRAPHIC_IS_GEN
 endif
 
+ifeq ($(BOARD_LIGHTS_BACKLIGHT_ASYNC),true)
+LOCAL_CFLAGS += -DLIGHT_BACKLIGHT_ASYNC
+endif
+
+ifeq ($(BOARD_LIGHTS_BACKLIGHT_ALS),true)
+LOCAL_CFLAGS += -DLIGHT_BACKLIGHT_ALS
+endif
+
+# 0 error .. 4 verbose; defaults to 2 (info), 4 with LIGHTS_DEBUG
+ifneq ($(BOARD_LIGHTS_LOG_LEVEL),)
+LOCAL_CFLAGS += -DLIGHTS_LOG_LEVEL=$(BOARD_LIGHTS_LOG_LEVEL)
+endif
+
 include $(BUILD_SHARED_LIBRARY)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
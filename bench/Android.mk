@@ -0,0 +1,30 @@
+LOCAL_PATH:= $(call my-dir)
+# Host benchmark: lights.c against stub headers and a fake sysfs tree.
+# mmm <this dir> && $(HOST_OUT_EXECUTABLES)/lights_bench
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := lights_bench.c
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/include $(LOCAL_PATH)/..
+LOCAL_LDLIBS := -lpthread -lrt -lm
+
+LOCAL_MODULE := lights_bench
+LOCAL_MODULE_TAGS := optional
+
+ifeq ($(BOARD_GRAPHIC_IS_GEN),true)
+LOCAL_CFLAGS += -DGRAPHIC_IS_GEN
+endif
+
+ifeq ($(BOARD_LIGHTS_BACKLIGHT_ASYNC),true)
+LOCAL_CFLAGS += -DLIGHT_BACKLIGHT_ASYNC
+endif
+
+ifeq ($(BOARD_LIGHTS_BACKLIGHT_ALS),true)
+LOCAL_CFLAGS += -DLIGHT_BACKLIGHT_ALS
+endif
+
+ifneq ($(BOARD_LIGHTS_LOG_LEVEL),)
+LOCAL_CFLAGS += -DLIGHTS_LOG_LEVEL=$(BOARD_LIGHTS_LOG_LEVEL)
+endif
+
+include $(BUILD_HOST_EXECUTABLE)
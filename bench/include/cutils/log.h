@@ -0,0 +1,31 @@
+/*
+ * Copyright 2008, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for <cutils/log.h>: errors to stderr, chatter compiled out. */
+
+#ifndef LIGHTS_BENCH_CUTILS_LOG_H
+#define LIGHTS_BENCH_CUTILS_LOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOGV(...)   do { } while (0)
+#define LOGD(...)   do { } while (0)
+#define LOGI(...)   fprintf(stderr, "I/" LOG_TAG ": " __VA_ARGS__)
+#define LOGW(...)   fprintf(stderr, "W/" LOG_TAG ": " __VA_ARGS__)
+#define LOGE(...)   fprintf(stderr, "E/" LOG_TAG ": " __VA_ARGS__)
+
+#endif /* LIGHTS_BENCH_CUTILS_LOG_H */
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2008, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for <hardware/lights.h>. */
+
+#ifndef LIGHTS_BENCH_HARDWARE_LIGHTS_H
+#define LIGHTS_BENCH_HARDWARE_LIGHTS_H
+
+#include <hardware/hardware.h>
+
+#define LIGHTS_HARDWARE_MODULE_ID "lights"
+
+#define LIGHT_ID_BACKLIGHT          "backlight"
+#define LIGHT_ID_KEYBOARD           "keyboard"
+#define LIGHT_ID_BUTTONS            "buttons"
+#define LIGHT_ID_BATTERY            "battery"
+#define LIGHT_ID_NOTIFICATIONS      "notifications"
+#define LIGHT_ID_ATTENTION          "attention"
+
+#define LIGHT_FLASH_NONE            0
+#define LIGHT_FLASH_TIMED           1
+#define LIGHT_FLASH_HARDWARE        2
+
+#define BRIGHTNESS_MODE_USER        0
+#define BRIGHTNESS_MODE_SENSOR      1
+
+struct light_state_t {
+    unsigned int color;
+    int flashMode;
+    int flashOnMS;
+    int flashOffMS;
+    int brightnessMode;
+};
+
+struct light_device_t {
+    struct hw_device_t common;
+    int (*set_light)(struct light_device_t* dev,
+            struct light_state_t const* state);
+};
+
+#endif /* LIGHTS_BENCH_HARDWARE_LIGHTS_H */
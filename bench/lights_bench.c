@@ -0,0 +1,426 @@
+/*
+ * Copyright 2008, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host benchmark for the lights HAL.
+ *
+ * Builds lights.c against the stub headers in include/, points it at a
+ * fake sysfs tree in a temporary directory through ro.lights.sysfs_root
+ * and drives it through the module's open() entry point like the
+ * framework does. For every light it reports set_light() latency
+ * percentiles and syscalls per call (from the nodes' own counters), then
+ * the throughput of a backlight burst, the wake-to-LED-on latency of
+ * the button auto-off path and what a breathing LED costs with and
+ * without the kernel LED triggers.
+ *
+ * usage: lights_bench [iterations]
+ */
+
+#define _GNU_SOURCE	/* nftw() */
+#define LOG_TAG "lights"
+
+#ifndef LIGHT_BUTTONS_AUTO_POWEROFF
+#define LIGHT_BUTTONS_AUTO_POWEROFF
+#endif
+
+#include "lights.c"
+
+#include <ftw.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#define BENCH_ITERATIONS    10000
+#define BENCH_BURST         10000
+#define BENCH_WAKE_SAMPLES  200
+#define BENCH_AUTO_OFF_MS   10
+#define BENCH_TIMEOUT_NS    1000000000LL
+#define BENCH_PATTERN_MS    2000
+
+struct bench_property {
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+};
+
+static struct bench_property bench_properties[8];
+static char bench_root[PATH_MAX];
+static char bench_event[PATH_MAX];
+static int bench_event_fd = -1;
+
+int property_get(const char *key, char *value, const char *default_value)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(bench_properties) / sizeof(bench_properties[0]); i++) {
+        if (!strcmp(bench_properties[i].key, key)) {
+            strcpy(value, bench_properties[i].value);
+            return strlen(value);
+        }
+    }
+    if (!default_value) {
+        value[0] = '\0';
+        return 0;
+    }
+    snprintf(value, PROPERTY_VALUE_MAX, "%s", default_value);
+    return strlen(value);
+}
+
+int property_set(const char *key, const char *value)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(bench_properties) / sizeof(bench_properties[0]); i++) {
+        if (!bench_properties[i].key[0] || !strcmp(bench_properties[i].key, key)) {
+            snprintf(bench_properties[i].key, PROPERTY_KEY_MAX, "%s", key);
+            snprintf(bench_properties[i].value, PROPERTY_VALUE_MAX, "%s", value);
+            return 0;
+        }
+    }
+
+    return -ENOSPC;
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* syscalls < 0: not attributable to the measured calls */
+static void report(const char *name, long long *samples, int n, long syscalls)
+{
+    qsort(samples, n, sizeof(samples[0]), cmp_ll);
+    printf("%-22s %8d %9.2f %9.2f %9.2f %9.2f", name, n,
+           samples[n / 2] / 1000.0, samples[n * 99 / 100] / 1000.0,
+           samples[n * 999 / 1000] / 1000.0, samples[n - 1] / 1000.0);
+    if (syscalls >= 0)
+        printf(" %9.3f\n", (double)syscalls / n);
+    else
+        printf(" %9s\n", "-");
+}
+
+static int write_file(const char *dir, const char *name, const char *value)
+{
+    char path[PATH_MAX];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "w");
+    if (!f)
+        return -errno;
+    fputs(value, f);
+    fclose(f);
+
+    return 0;
+}
+
+static int make_node(const char *class_dir, int max, const char *type)
+{
+    char dir[PATH_MAX], value[16];
+
+    snprintf(dir, sizeof(dir), "%s/%s", bench_root, class_dir);
+    *strrchr(dir, '/') = '\0';
+    mkdir(dir, 0755);
+    snprintf(dir, sizeof(dir), "%s/%s", bench_root, class_dir);
+    if (mkdir(dir, 0755))
+        return -errno;
+
+    snprintf(value, sizeof(value), "%d\n", max);
+    if (write_file(dir, "brightness", "0\n")
+        || write_file(dir, "max_brightness", value)
+        || (type && write_file(dir, "type", type)))
+        return -EIO;
+
+    return 0;
+}
+
+/* what the timer and pattern triggers add to an LED class device */
+static int make_triggers(const char *class_dir)
+{
+    char dir[PATH_MAX];
+
+    snprintf(dir, sizeof(dir), "%s/%s", bench_root, class_dir);
+    if (write_file(dir, "trigger", "[none] timer pattern\n")
+        || write_file(dir, "delay_on", "0\n")
+        || write_file(dir, "delay_off", "0\n")
+        || write_file(dir, "pattern", "\n")
+        || write_file(dir, "repeat", "-1\n"))
+        return -EIO;
+
+    return 0;
+}
+
+static int setup_tree(void)
+{
+    const char *tmp = getenv("TMPDIR");
+
+    snprintf(bench_root, sizeof(bench_root), "%s/lights-bench.XXXXXX",
+             tmp ? tmp : "/tmp");
+    if (!mkdtemp(bench_root))
+        return -errno;
+
+    if (make_node("backlight/intel_backlight", 4882, "raw\n")
+        || make_node("leds/keyboard-backlight", 255, NULL)
+        || make_node("leds/intel_keypad_led", 255, NULL)
+        || make_node("leds/battery-backlight", 255, NULL)
+        || make_node("leds/notifications-backlight", 255, NULL)
+        || make_node("leds/attention-backlight", 255, NULL)
+        || make_triggers("leds/attention-backlight"))
+        return -EIO;
+
+    /* the touch key device is a FIFO we write input_events into */
+    snprintf(bench_event, sizeof(bench_event), "%s/event-touchkey", bench_root);
+    if (mkfifo(bench_event, 0600))
+        return -errno;
+    /*
+     * The writer end stays open for the whole run: closing it hangs the
+     * FIFO up, and the HAL drops a wake source that hangs up. O_RDWR so
+     * the open doesn't wait for the HAL to show up as a reader.
+     */
+    bench_event_fd = open(bench_event, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (bench_event_fd < 0)
+        return -errno;
+    button_wake_events[0].file = bench_event;
+    button_light_info.auto_off_ms = BENCH_AUTO_OFF_MS;
+
+    return property_set(LIGHT_PROP_SYSFS_ROOT, bench_root);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static struct light_device_t *bench_open(const char *id)
+{
+    struct hw_device_t *device;
+    int ret;
+
+    ret = HAL_MODULE_INFO_SYM.methods->open(&HAL_MODULE_INFO_SYM, id, &device);
+    if (ret) {
+        fprintf(stderr, "open %s failed: %d\n", id, ret);
+        return NULL;
+    }
+
+    return (struct light_device_t *)device;
+}
+
+static int node_intensity(enum light_type type)
+{
+    return *(volatile int *)&context->nodes[type].last_intensity;
+}
+
+static void bench_set_light(const char *id, enum light_type type,
+                            long long *samples, int iterations)
+{
+    struct light_device_t *dev = bench_open(id);
+    struct light_state_t state;
+    unsigned long syscalls;
+    long long start;
+    int i, level;
+
+    if (!dev)
+        return;
+
+    memset(&state, 0, sizeof(state));
+    syscalls = context->nodes[type].syscalls;
+    for (i = 0; i < iterations; i++) {
+        /* every call asks for a different value than the one before */
+        if (type == LIGHT_TYPE_BACKLIGHT) {
+            level = (i * 7) % 256;
+            state.color = 0xff000000 | (level << 16) | (level << 8) | level;
+        } else {
+            state.color = i & 1 ? 0xffffffff : 0xff000000;
+        }
+        start = now_ns();
+        dev->set_light(dev, &state);
+        samples[i] = now_ns() - start;
+    }
+    report(id, samples, iterations, context->nodes[type].syscalls - syscalls);
+}
+
+static void bench_burst(int count)
+{
+    struct light_device_t *dev = bench_open(LIGHT_ID_BACKLIGHT);
+    struct light_node *node = &context->nodes[LIGHT_TYPE_BACKLIGHT];
+    struct light_state_t state;
+    unsigned long syscalls;
+    long long start, elapsed;
+    int i, target;
+
+    if (!dev)
+        return;
+
+    memset(&state, 0, sizeof(state));
+    syscalls = node->syscalls;
+    start = now_ns();
+    for (i = 0; i < count; i++) {
+        state.color = 0xff000000 | ((i & 0xff) * 0x010101);
+        dev->set_light(dev, &state);
+    }
+    /* an asynchronous writer is done once the last value is out */
+    target = node->intensity[(count - 1) & 0xff];
+    while (node_intensity(LIGHT_TYPE_BACKLIGHT) != target
+           && now_ns() - start < BENCH_TIMEOUT_NS)
+        sched_yield();
+    elapsed = now_ns() - start;
+
+    printf("\nbacklight burst: %d calls in %.2f ms, %.0f calls/s, %lu syscalls\n",
+           count, elapsed / 1e6, count * 1e9 / elapsed, node->syscalls - syscalls);
+}
+
+static void bench_wake(long long *samples, int iterations)
+{
+    struct light_device_t *dev;
+    struct light_state_t state;
+    struct input_event event[2];
+    long long start;
+    int i, n = 0;
+
+    dev = bench_open(LIGHT_ID_BUTTONS);
+    if (!dev || !context->infos[LIGHT_TYPE_BUTTONS]) {
+        fprintf(stderr, "button auto off is not running\n");
+        return;
+    }
+
+    memset(&state, 0, sizeof(state));
+    state.color = 0xffffffff;
+    dev->set_light(dev, &state);
+
+    memset(event, 0, sizeof(event));
+    event[0].type = EV_KEY;
+    event[0].code = KEY_BACK;
+    event[0].value = 1;
+    event[1].type = EV_SYN;
+
+    for (i = 0; i < iterations; i++) {
+        start = now_ns();
+        while (node_intensity(LIGHT_TYPE_BUTTONS) != 0
+               && now_ns() - start < BENCH_TIMEOUT_NS)
+            usleep(1000);
+
+        start = now_ns();
+        if (write(bench_event_fd, event, sizeof(event)) != sizeof(event))
+            break;
+        while (node_intensity(LIGHT_TYPE_BUTTONS) == 0
+               && now_ns() - start < BENCH_TIMEOUT_NS)
+            sched_yield();
+        samples[n++] = now_ns() - start;
+    }
+
+    printf("\n%-22s %8s %9s %9s %9s %9s %9s\n", "wake to LED on", "samples",
+           "p50 us", "p99 us", "p99.9 us", "max us", "sys/call");
+    if (n)
+        report("buttons", samples, n, -1);
+}
+
+/* the attention LED breathes in its (fake) pattern trigger, notifications
+ * on the HAL scheduler: HAL writes, syscalls and CPU time (all threads,
+ * the bench just sleeps) per second of each */
+static void bench_pattern(const char *id, enum light_type type)
+{
+    struct light_device_ext_t *dev = (struct light_device_ext_t *)bench_open(id);
+    struct light_node *node = &context->nodes[type];
+    struct light_pattern_t pattern = {500, 250, 500, 250, 0};
+    struct light_state_t state;
+    unsigned long writes, syscalls;
+    long long cpu;
+    int offloaded;
+
+    if (!dev || !dev->set_light_pattern)
+        return;
+
+    memset(&state, 0, sizeof(state));
+    state.color = 0xffffffff;
+    writes = node->stats.writes;
+    syscalls = node->syscalls;
+    cpu = cpu_ns();
+    dev->set_light_pattern(dev, &state, &pattern);
+    usleep(BENCH_PATTERN_MS * 1000);
+    cpu = cpu_ns() - cpu;
+    offloaded = context->blinks[type].offloaded;
+    writes = node->stats.writes - writes;
+    syscalls = node->syscalls - syscalls;
+
+    state.color = 0xff000000;
+    dev->common.set_light(&dev->common, &state);
+
+    printf("%-22s %9s %9.1f %9.1f %9.1f\n", id, offloaded ? "kernel" : "hal",
+           writes * 1000.0 / BENCH_PATTERN_MS,
+           syscalls * 1000.0 / BENCH_PATTERN_MS,
+           (double)cpu / BENCH_PATTERN_MS);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : BENCH_ITERATIONS;
+    long long *samples;
+    int ret;
+
+    if (iterations <= 0)
+        iterations = BENCH_ITERATIONS;
+    samples = malloc(sizeof(*samples) * (iterations > BENCH_WAKE_SAMPLES
+                                         ? iterations : BENCH_WAKE_SAMPLES));
+    if (!samples)
+        return 1;
+
+    ret = setup_tree();
+    if (ret) {
+        fprintf(stderr, "failed to set up fake sysfs: %d\n", ret);
+        return 1;
+    }
+    printf("fake sysfs at %s\n\n", bench_root);
+
+    printf("%-22s %8s %9s %9s %9s %9s %9s\n", "set_light", "calls",
+           "p50 us", "p99 us", "p99.9 us", "max us", "sys/call");
+    bench_set_light(LIGHT_ID_BACKLIGHT, LIGHT_TYPE_BACKLIGHT, samples, iterations);
+    bench_set_light(LIGHT_ID_KEYBOARD, LIGHT_TYPE_KEYBOARD, samples, iterations);
+    bench_set_light(LIGHT_ID_BATTERY, LIGHT_TYPE_BATTERY, samples, iterations);
+    bench_set_light(LIGHT_ID_NOTIFICATIONS, LIGHT_TYPE_NOTIFICATIONS, samples,
+                    iterations);
+    bench_set_light(LIGHT_ID_ATTENTION, LIGHT_TYPE_ATTENTION, samples, iterations);
+
+    bench_burst(BENCH_BURST);
+    bench_wake(samples, BENCH_WAKE_SAMPLES);
+
+    printf("\n%-22s %9s %9s %9s %9s\n", "breathing pattern", "run by",
+           "writes/s", "sys/s", "cpu us/s");
+    bench_pattern(LIGHT_ID_ATTENTION, LIGHT_TYPE_ATTENTION);
+    bench_pattern(LIGHT_ID_NOTIFICATIONS, LIGHT_TYPE_NOTIFICATIONS);
+
+    close(bench_event_fd);
+    nftw(bench_root, remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+    free(samples);
+
+    return 0;
+}
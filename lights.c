@@ -16,20 +16,122 @@
 
 #define LOG_TAG "lights"
 
+/*
+ * Log levels of this module. Everything above LIGHTS_LOG_LEVEL is compiled
+ * out: release builds keep errors, warnings and info, LIGHTS_DEBUG builds
+ * (or an explicit LIGHTS_LOG_LEVEL) get the debug and verbose chatter too.
+ */
+#define LIGHTS_LOG_ERROR    0
+#define LIGHTS_LOG_WARN     1
+#define LIGHTS_LOG_INFO     2
+#define LIGHTS_LOG_DEBUG    3
+#define LIGHTS_LOG_VERBOSE  4
+
+#ifndef LIGHTS_LOG_LEVEL
+#ifdef LIGHTS_DEBUG
+#define LIGHTS_LOG_LEVEL    LIGHTS_LOG_VERBOSE
+#else
+#define LIGHTS_LOG_LEVEL    LIGHTS_LOG_INFO
+#endif
+#endif
+
+#if LIGHTS_LOG_LEVEL >= LIGHTS_LOG_VERBOSE && !defined(LOG_NDEBUG)
+#define LOG_NDEBUG 0        /* let LOGV through */
+#endif
+
+#include <math.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stddef.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 #include <hardware/lights.h>
 #include <linux/input.h>
 
+#include "lights_ext.h"
+
+#define lights_log(__level, __log, ...)             \
+        do {                                        \
+            if ((__level) <= LIGHTS_LOG_LEVEL)      \
+                __log(__VA_ARGS__);                 \
+        } while (0)
+
+#define LIGHTS_LOGE(...)    lights_log(LIGHTS_LOG_ERROR, LOGE, __VA_ARGS__)
+#define LIGHTS_LOGW(...)    lights_log(LIGHTS_LOG_WARN, LOGW, __VA_ARGS__)
+#define LIGHTS_LOGI(...)    lights_log(LIGHTS_LOG_INFO, LOGI, __VA_ARGS__)
+#define LIGHTS_LOGD(...)    lights_log(LIGHTS_LOG_DEBUG, LOGD, __VA_ARGS__)
+#define LIGHTS_LOGV(...)    lights_log(LIGHTS_LOG_VERBOSE, LOGV, __VA_ARGS__)
+
+/*
+ * Rate limiting per call site: at most LIGHTS_LOG_RATE_BURST messages per
+ * LIGHTS_LOG_RATE_INTERVAL seconds, then one line saying how many were
+ * dropped once the site may log again. Counters are updated atomically
+ * but the window roll-over is not serialized, so a racing caller may
+ * sneak one extra message through; good enough for a log.
+ */
+#define LIGHTS_LOG_RATE_INTERVAL    5
+#define LIGHTS_LOG_RATE_BURST       10
+
+struct lights_ratelimit {
+    time_t begin;
+    unsigned int count;
+    unsigned int missed;
+};
+
+static int lights_ratelimit(struct lights_ratelimit *rl, unsigned int *missed)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!rl->begin || now.tv_sec - rl->begin >= LIGHTS_LOG_RATE_INTERVAL) {
+        rl->begin = now.tv_sec;
+        rl->count = 0;
+    }
+    if (__sync_fetch_and_add(&rl->count, 1) >= LIGHTS_LOG_RATE_BURST) {
+        __sync_fetch_and_add(&rl->missed, 1);
+        return 0;
+    }
+    *missed = __sync_lock_test_and_set(&rl->missed, 0);
+
+    return 1;
+}
+
+#define lights_log_ratelimited(__level, __log, ...)                     \
+        do {                                                            \
+            static struct lights_ratelimit __rl;                        \
+            unsigned int __missed;                                      \
+            if ((__level) <= LIGHTS_LOG_LEVEL &&                        \
+                lights_ratelimit(&__rl, &__missed)) {                   \
+                if (__missed)                                           \
+                    __log("%u similar messages suppressed\n", __missed); \
+                __log(__VA_ARGS__);                                     \
+            }                                                           \
+        } while (0)
+
+#define LIGHTS_LOGE_RL(...) \
+        lights_log_ratelimited(LIGHTS_LOG_ERROR, LOGE, __VA_ARGS__)
+#define LIGHTS_LOGW_RL(...) \
+        lights_log_ratelimited(LIGHTS_LOG_WARN, LOGW, __VA_ARGS__)
+#define LIGHTS_LOGD_RL(...) \
+        lights_log_ratelimited(LIGHTS_LOG_DEBUG, LOGD, __VA_ARGS__)
+
 /* #ifdef LIGHT_BUTTONS_AUTO_POWEROFF */
 
 #define LIGHT_LED_OFF   0
@@ -37,440 +139,3597 @@
 
 #define LIGHT_PATH_BASE "/sys/class"
 
+/* overrides LIGHT_PATH_BASE, e.g. to point the HAL at a fake sysfs tree */
+#define LIGHT_PROP_SYSFS_ROOT   "ro.lights.sysfs_root"
+
+/*
+ * Lights are looked up at first open: the backlight is the best ranked
+ * device of the backlight class, each LED the best match for its names in
+ * the leds class. The directories below (relative to the sysfs root) are
+ * used for lights nothing was found for, as this HAL always did.
+ */
 #ifdef GRAPHIC_IS_GEN
-#define LIGHT_ID_BACKLIGHT_PATH                         \
-    LIGHT_PATH_BASE"/backlight/intel_backlight/brightness"
-#define LIGHT_ID_MAX_BACKLIGHT_PATH                     \
-    LIGHT_PATH_BASE"/backlight/intel_backlight/max_brightness"
+#define LIGHT_BACKLIGHT_DEFAULT "intel_backlight"
 #else
-#define LIGHT_ID_BACKLIGHT_PATH                         \
-    LIGHT_PATH_BASE"/backlight/psb-bl/brightness"
-#define LIGHT_ID_MAX_BACKLIGHT_PATH                     \
-    LIGHT_PATH_BASE"/backlight/psb-bl/max_brightness"
+#define LIGHT_BACKLIGHT_DEFAULT "psb-bl"
 #endif /* CONFIG_INTEL_GEN_GRAPHICS */
 
+#define LIGHT_ID_BACKLIGHT_DIR      "backlight/"LIGHT_BACKLIGHT_DEFAULT
 /* if cdk board have leds, new sys path related to leds should be defined. */
-#define LIGHT_ID_KEYBOARD_PATH                          \
-    LIGHT_PATH_BASE"/keyboard-backlight/brightness"
-#define LIGHT_ID_BUTTONS_PATH                           \
-	LIGHT_PATH_BASE"/leds/intel_keypad_led/brightness"
-#define LIGHT_ID_BATTERY_PATH                           \
-    LIGHT_PATH_BASE"/battery-backlight/brightness"
-#define LIGHT_ID_NOTIFICATIONS_PATH                     \
-    LIGHT_PATH_BASE"/notifications-backlight/brightness"
-#define LIGHT_ID_ATTENTION_PATH                         \
-    LIGHT_PATH_BASE"/attention-baklight/brightness"
+#define LIGHT_ID_KEYBOARD_DIR       "keyboard-backlight"
+#define LIGHT_ID_BUTTONS_DIR        "leds/intel_keypad_led"
+#define LIGHT_ID_BATTERY_DIR        "battery-backlight"
+#define LIGHT_ID_NOTIFICATIONS_DIR  "notifications-backlight"
+#define LIGHT_ID_ATTENTION_DIR      "attention-baklight"
 
 #define BRIGHT_MAX_BAR      255
-#define bright_to_intensity(__max, __br, __its)     \
-        do {                                        \
-                __its = __max * __br;      \
-                __its = __its / BRIGHT_MAX_BAR;     \
-        } while (0)
+#define LIGHT_INTENSITY_STR 12      /* "%d\n" of any int */
+
+#define LIGHT_CURVE_GAMMA_EXP   2.2f
+
+/*
+ * How framework brightness maps to hardware intensity, per light id and
+ * read once, when the light is first opened (or its driver re-probed):
+ *   lights.<id>.curve   linear (default), gamma or cie
+ *   lights.<id>.points  "brightness:permille,..." breakpoints, linearly
+ *                       interpolated and anchored at 0:0 and 255:1000;
+ *                       overrides curve
+ *   lights.<id>.floor   lowest intensity written for brightness >= 1
+ */
+#define LIGHT_PROP_CURVE        "lights.%s.curve"
+#define LIGHT_PROP_POINTS       "lights.%s.points"
+#define LIGHT_PROP_FLOOR        "lights.%s.floor"
+#define LIGHT_CURVE_POINTS_MAX  12
+#define LIGHT_RAMP_MIN_STEP_MS  4
 
-#define WAKE_EVENT_MAX		8
 #define WAKE_KEY_MAX		32
+#define WAKE_READ_BATCH		64
 #define KEY_ANY			(KEY_MAX+0x1)
 
+#define LIGHT_BITS_PER_LONG	(sizeof(unsigned long) * 8)
+#define LIGHT_BITS_TO_LONGS(__n)	\
+	(((__n) + LIGHT_BITS_PER_LONG - 1) / LIGHT_BITS_PER_LONG)
+
+/* from <linux/input.h> of 4.4+ kernels, older kernels reject it */
+#ifndef EVIOCSMASK
+struct input_mask {
+	__u32 type;
+	__u32 codes_size;
+	__u64 codes_ptr;
+};
+
+#define EVIOCSMASK		_IOW('E', 0x93, struct input_mask)
+#endif
+
+#ifndef CLOCK_BOOTTIME
+#define CLOCK_BOOTTIME		7
+#endif
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+/*
+ * Everything the HAL waits for -- wake input devices, auto-off and blink
+ * timers, requests posted by set_light() -- is multiplexed on a single
+ * epoll loop thread. Each fd is registered with a lights_watch whose
+ * handler runs on that thread when the fd becomes readable.
+ */
+struct lights_watch {
+	int fd;
+	unsigned int events;	/* EPOLL* reported for this wake up */
+	void (*handler)(struct lights_watch *watch);
+};
+
+#define LIGHTS_LOOP_BATCH	8
+#define LIGHTS_LOOP_INFO_MAX	4
+
+struct light_info;
+
+struct lights_loop {
+	int epoll_fd;
+	struct lights_watch request;	/* eventfd kicked by set_light() */
+	int nr_infos;
+	struct light_info *infos[LIGHTS_LOOP_INFO_MAX];
+	pthread_mutex_t lock;
+};
+
+static struct lights_loop event_loop = {
+	.epoll_fd = -1,
+	.request = {.fd = -1,},
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define LIGHT_INPUT_DIR		"/dev/input"
+#define LIGHT_INPUT_NAME_MAX	80
+
+/* one input device attached to a wake event */
+struct light_wake_dev {
+	struct lights_watch watch;	/* fd < 0: slot free */
+	int num;			/* N of LIGHT_INPUT_DIR/eventN */
+	struct light_wake_event *wake;
+};
+
+/*
+ * key lists the wake keys (KEY_ANY: all of them, -1 ends the list); it is
+ * turned into the keys bitmap at init, which both the matching and the
+ * kernel event mask use.
+ *
+ * Devices are matched as they show up in LIGHT_INPUT_DIR: by name when
+ * one is known, else by reporting every key of need (ended by -1 or
+ * KEY_RESERVED, so it can be left out), else by being file. file is the
+ * last resort: it is only looked at when neither of the others found a
+ * device at init, and then its name is learnt so the device is found
+ * again under another node number after a driver reload. Either way a
+ * device must also report type and, for EV_KEY, at least one of the
+ * wake keys.
+ */
 struct light_wake_event {
 	char	*file;
 	int	type;
 	int	key[WAKE_KEY_MAX];
-	int	fd;
+	int	need[WAKE_KEY_MAX];
+	char	name[LIGHT_INPUT_NAME_MAX];
+	unsigned long keys[LIGHT_BITS_TO_LONGS(KEY_CNT)];
+	unsigned long needs[LIGHT_BITS_TO_LONGS(KEY_CNT)];
+	int	nr_needs;
+	/*
+	 * Grown as devices attach, slots are reused but never freed or
+	 * moved: epoll and the batch being handled may still point at one
+	 * that was just detached.
+	 */
+	struct light_wake_dev **devs;
+	int nr_devs;
+	struct light_info *info;
 };
+/*
+ * request is everything set_light() and the wake handlers hand to the
+ * event loop, in one word updated with compare-and-swap: the brightness
+ * asked for, whether the loop has yet to act on it, and a generation
+ * counted up by every set_light(). Neither side ever waits on the other;
+ * the sysfs write happens on the loop with nothing held.
+ */
+#define LIGHT_REQ_BRIGHTNESS	0xffu
+#define LIGHT_REQ_PENDING	0x100u
+#define LIGHT_REQ_GEN_SHIFT	9
+
 struct light_info {
 	char *name;
-	int fd;
-	unsigned char brightness;
-	unsigned char brightness_status;
-	int need_update;
-	int need_auto_off;
-	int auto_off_time;
-	pthread_mutex_t lock;
-	pthread_cond_t  cond;
-	struct light_wake_event events[WAKE_EVENT_MAX];
+	struct light_node *node;
+	volatile unsigned int request;
+	unsigned int generation;	/* last one the loop acted on */
+	int brightness_status;		/* -1: unknown, written on first update */
+	int auto_off_ms;
+	struct lights_watch timer;	/* auto-off deadline */
+	int nr_events;
+	struct light_wake_event *events;
+};
+
+/*
+ * Capabilities of the input devices seen so far, keyed by id and name, so
+ * a device that keeps coming and going costs two ioctls instead of four.
+ */
+#define LIGHT_CAPS_CACHE	16
+
+struct light_input_caps {
+	int valid;
+	struct input_id id;
+	char name[LIGHT_INPUT_NAME_MAX];
+	unsigned long types[LIGHT_BITS_TO_LONGS(EV_CNT)];
+	unsigned long keys[LIGHT_BITS_TO_LONGS(KEY_CNT)];
+};
+
+static struct light_hotplug {
+	struct lights_watch watch;	/* inotify on LIGHT_INPUT_DIR */
+	struct light_input_caps cache[LIGHT_CAPS_CACHE];
+	int next;			/* cache slot to replace */
+	pthread_mutex_t lock;		/* cache and every devs[] */
+} input_hotplug = {
+	.watch = {.fd = -1,},
+	.lock = PTHREAD_MUTEX_INITIALIZER,
 };
 
 #ifdef LIGHT_BUTTONS_AUTO_POWEROFF
 #define TOUCH_KEY_EVENT_PATH "/dev/input/event1"
+static struct light_wake_event button_wake_events[] = {
+	/*touch key: the menu and back keys of the panel, wherever it shows up*/
+	{.type = EV_KEY, .key = {KEY_ANY, -1}, .need = {KEY_MENU, KEY_BACK, -1},
+	 .file = TOUCH_KEY_EVENT_PATH,},
+};
+
 static struct light_info button_light_info = {
 	.name = "button light",
-	.auto_off_time = 5,
-	.events = {
-		/*touch key*/
-		{.type = EV_KEY, .key = {KEY_ANY, -1}, .file = TOUCH_KEY_EVENT_PATH,},
-	},
+	.auto_off_ms = 5000,
+	.nr_events = sizeof(button_wake_events) / sizeof(button_wake_events[0]),
+	.events = button_wake_events,
 };
 #endif
 
-struct lights_fds {
-    int backlight;
-    int keyboard;
-    int buttons;
-    int battery;
-    int notifications;
-    int attention;
+/*
+ * Backlight ramp in hardware units: from/to are intensities on the
+ * 0..max_brightness scale, p_from/p_to the same points in the perceptual
+ * space of curve, which is where the ramp interpolates.
+ */
+struct light_ramp {
+	int from;
+	int to;
+	int max;
+	int duration_ms;
+	int curve;
+	float p_from;
+	float p_to;
+	struct timespec start;
 };
 
-static struct lights_ctx {
-    struct lights_fds fds;
-#ifdef LIGHT_BUTTONS_AUTO_POWEROFF
-    struct light_info *button_info;
+/*
+ * Backlight writer thread. set_light() only stores the target brightness
+ * in pending and returns, the writer drains it and writes the newest
+ * value, so a burst of updates while a write is in flight collapses into
+ * a single write of the last one. The same thread runs ramps, stepping
+ * the PWM towards ramp.to until a newer request supersedes it.
+ */
+struct light_writer {
+	char *name;
+	struct light_node *node;
+	volatile int pending;	/* brightness to write, -1 when drained */
+	volatile int ramp_pending;	/* ramp holds a new request */
+	struct light_ramp ramp;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+};
+
+static struct light_writer backlight_writer = {
+	.name = "backlight writer",
+	.pending = -1,
+};
+
+/*
+ * Runtime counters of one light, updated with atomic adds from whichever
+ * thread touches the light and rendered by lights_dump(). latency is a
+ * log2 histogram of sysfs write time: bucket 0 counts writes under 1us,
+ * bucket i those under 2^i us, the last one everything slower.
+ */
+#define LIGHT_STATS_ERRNO_MAX   128	/* errno >= this counts as 0 */
+#define LIGHT_STATS_BUCKETS     24
+
+struct light_stats {
+    unsigned long calls;	/* set_light() and friends */
+    unsigned long writes;	/* sysfs writes issued */
+    unsigned long coalesced;	/* writes skipped, value unchanged */
+    unsigned long auto_off;	/* auto-off timer turned the light off */
+    unsigned long wakes;	/* input events that woke the light */
+    unsigned long deferred;	/* updates held back while the display was off */
+    unsigned long errors[LIGHT_STATS_ERRNO_MAX];
+    unsigned long latency[LIGHT_STATS_BUCKETS];
+};
+
+#define stats_inc(__counter)    __sync_fetch_and_add(&(__counter), 1)
+
+struct light_curve_map {
+    int curve;
+    int floor;
+    int nr_points;	/* breakpoints in use, 0 for curve */
+    int in[LIGHT_CURVE_POINTS_MAX + 2];
+    int out[LIGHT_CURVE_POINTS_MAX + 2];	/* permille of max_brightness */
+};
+
+/* LED class triggers flashing can be offloaded to */
+#define LIGHT_TRIGGER_TIMER     (1 << 0)	/* delay_on, delay_off */
+#define LIGHT_TRIGGER_PATTERN   (1 << 1)	/* pattern, repeat */
+
+/*
+ * One opened sysfs brightness attribute. max_brightness is read once when
+ * the node is opened and only re-read when the device is re-probed, so the
+ * steady-state write path is a single pwrite(). syscalls counts every
+ * syscall issued on behalf of the node, which makes that checkable.
+ * last_intensity is the value the node was last successfully written
+ * with, or -1 when unknown; writes of the same value are skipped.
+ */
+struct light_node {
+    const char *id;	/* light id, names the curve properties */
+    const char *path;
+    const char *max_path;
+    int fd;
+    int max_brightness;
+    int last_intensity;
+    int coalesce;	/* skip writes of last_intensity */
+    int triggers;	/* LIGHT_TRIGGER_* offered, -1: not probed yet */
+    unsigned long syscalls;	/* stats_inc(): counted from every thread */
+    struct light_stats stats;
+    struct light_curve_map curve;	/* level -> intensity */
+    /* brightness -> intensity, and the "%d\n" encoding of that intensity */
+    int intensity[BRIGHT_MAX_BAR + 1];
+    unsigned char lengths[BRIGHT_MAX_BAR + 1];
+    char strings[BRIGHT_MAX_BAR + 1][LIGHT_INTENSITY_STR];
+};
+
+enum light_type {
+    LIGHT_TYPE_BACKLIGHT,
+    LIGHT_TYPE_KEYBOARD,
+    LIGHT_TYPE_BUTTONS,
+    LIGHT_TYPE_BATTERY,
+    LIGHT_TYPE_NOTIFICATIONS,
+    LIGHT_TYPE_ATTENTION,
+    LIGHT_TYPE_MAX,
+};
+
+/*
+ * An RGB(W) LED exported as one LED class device per colour channel
+ * ("<dev>:red", "<dev>:green", ...) and driven as one light. Each channel
+ * is a node of its own with its own max_brightness, curve and coalescing;
+ * balance scales the channels (permille) to white-balance the package.
+ */
+enum light_channel {
+    LIGHT_CHANNEL_RED,
+    LIGHT_CHANNEL_GREEN,
+    LIGHT_CHANNEL_BLUE,
+    LIGHT_CHANNEL_WHITE,	/* optional */
+    LIGHT_CHANNEL_MAX,
+};
+
+/* "r,g,b[,w]" in permille */
+#define LIGHT_PROP_RGB_BALANCE  "lights.rgb.balance"
+
+struct light_rgb {
+    int present;	/* red, green and blue are open */
+    struct light_node channels[LIGHT_CHANNEL_MAX];	/* fd < 0: absent */
+    int balance[LIGHT_CHANNEL_MAX];
+    pthread_mutex_t lock;
+};
+
+/*
+ * Timed flashing or breathing of one LED. When the LED class device has a
+ * "timer" (plain blinks) or "pattern" trigger the kernel runs it
+ * (offloaded); otherwise it is queued on the scheduler, which steps every
+ * pending LED from one thread ordered by a min-heap of deadlines.
+ */
+enum light_phase {
+    LIGHT_PHASE_RISE,
+    LIGHT_PHASE_ON,
+    LIGHT_PHASE_FALL,
+    LIGHT_PHASE_OFF,
+    LIGHT_PHASE_MAX,
+};
+
+/* ramps run on the scheduler are stepped at most this often */
+#define LIGHT_PATTERN_STEP_MS	50
+
+struct light_blink {
+    struct light_node *node;
+    struct light_rgb *rgb;	/* channels to drive instead of node */
+    unsigned char brightness;	/* as requested by the framework */
+    unsigned int color;		/* 0x00rrggbb, for rgb */
+    int level;		/* intensity of the on phase */
+    struct light_pattern_t pattern;
+    enum light_phase phase;
+    int repeat;		/* periods left, 0: forever */
+    int offloaded;
+    int index;		/* position in the scheduler heap, -1 if idle */
+    struct timespec phase_end;
+    struct timespec deadline;	/* of the next step, phase_end off a ramp */
+};
+
+#define LIGHT_BLINK_MAX		4
+
+struct light_scheduler {
+    struct lights_watch timer;
+    int count;
+    struct light_blink *heap[LIGHT_BLINK_MAX];
+    pthread_mutex_t lock;
+};
+
+static struct light_scheduler blink_scheduler = {
+    .timer = {.fd = -1,},
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#ifdef LIGHT_BACKLIGHT_ALS
+/*
+ * Auto-brightness for BRIGHTNESS_MODE_SENSOR: an ambient light sensor
+ * attribute is polled from the event loop, smoothed with separate
+ * brighten/darken time constants and, once the smoothed lux has moved
+ * past the hysteresis band, mapped to a backlight level and faded to on
+ * the backlight writer. Polling is fast while the light is changing and
+ * slows down once it settles.
+ */
+#define LIGHT_PROP_ALS_PATH         "lights.als.path"
+#define LIGHT_ALS_PATH_DEFAULT      \
+        "/sys/bus/iio/devices/iio:device0/in_illuminance_input"
+#define LIGHT_ALS_POLL_FAST_MS      250
+#define LIGHT_ALS_POLL_SLOW_MS      1000
+#define LIGHT_ALS_BRIGHTEN_TAU_MS   1000.0f
+#define LIGHT_ALS_DARKEN_TAU_MS     4000.0f
+#define LIGHT_ALS_HYSTERESIS        0.15f	/* of the lux last followed */
+#define LIGHT_ALS_LUX_MAX           10000.0f	/* full brightness */
+#define LIGHT_ALS_LEVEL_MIN         (LIGHT_LEVEL_MAX / 32)
+#define LIGHT_ALS_FADE_MS           400
+
+struct light_als {
+    struct lights_watch timer;
+    int fd;		/* sensor attribute, -1: not opened */
+    int enabled;
+    float lux;		/* filtered */
+    float anchor;	/* filtered lux the backlight follows, < 0: none */
+    struct timespec sampled;
+    pthread_mutex_t lock;
+};
+
+static struct light_als backlight_als = {
+    .timer = {.fd = -1,},
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
 #endif
+
+/*
+ * Backlights besides the primary one (the best ranked, which is
+ * nodes[LIGHT_TYPE_BACKLIGHT]), e.g. an external panel. How a backlight
+ * request reaches them is lights.backlight.route:
+ *   primary  only the primary panel (default)
+ *   mirror   every panel gets the same level
+ *   scale    every panel gets the level scaled by its entry of
+ *            lights.backlight.scale, "primary,second,..." in permille
+ * Each extra panel has its own node (curve properties under the id
+ * backlight1, backlight2, ...) and its own writer thread, so writes to
+ * several panels run side by side.
+ */
+#define LIGHT_PANEL_MAX             4	/* primary included */
+#define LIGHT_PROP_BACKLIGHT_ROUTE  "lights.backlight.route"
+#define LIGHT_PROP_BACKLIGHT_SCALE  "lights.backlight.scale"
+
+enum light_route {
+    LIGHT_ROUTE_PRIMARY,
+    LIGHT_ROUTE_MIRROR,
+    LIGHT_ROUTE_SCALE,
+};
+
+struct light_panel {
+    char id[16];
+    struct light_node node;
+    struct light_writer writer;
+};
+
+/* where a light was found, filled once by lights_discover() */
+struct light_location {
+    int rank;		/* 0: nothing found, legacy directory used */
+    char name[NAME_MAX + 1];
+    char path[PATH_MAX];
+    char max_path[PATH_MAX];
+};
+
+static char lights_sysfs_root[PATH_MAX];
+static struct light_location light_locations[LIGHT_TYPE_MAX];
+static struct light_location light_channel_locations[LIGHT_CHANNEL_MAX];
+static struct light_location light_panel_locations[LIGHT_PANEL_MAX];
+static pthread_once_t light_discover_once = PTHREAD_ONCE_INIT;
+
+/*
+ * While the display is off (backlight written 0, or a LIGHT_POWER_* hint)
+ * updates to lights that are not write-through only replace the cached
+ * state; the last one is written when the display comes back. By default
+ * that is the keyboard and buttons only: the framework lights the others,
+ * notifications above all, precisely while the screen is off.
+ */
+#define LIGHT_PROP_WRITE_THROUGH    "lights.write_through"
+#define LIGHT_WRITE_THROUGH_DEFAULT "attention,battery,notifications"
+
+struct light_deferred {
+    const struct light_desc *desc;	/* NULL: nothing deferred */
+    struct light_state_t state;
+    int patterned;	/* from set_light_pattern(), pattern applies */
+    struct light_pattern_t pattern;
+};
+
+static struct lights_ctx {
+    struct light_node nodes[LIGHT_TYPE_MAX];
+    struct light_blink blinks[LIGHT_TYPE_MAX];
+    struct light_rgb rgb;	/* notifications, when split by colour */
+    int power_state;		/* LIGHT_POWER_* */
+    int write_through[LIGHT_TYPE_MAX];	/* written even when not ON */
+    struct light_deferred deferred[LIGHT_TYPE_MAX];
+    pthread_mutex_t power_lock;	/* power_state, deferred, LED writes */
+    struct light_info *infos[LIGHT_TYPE_MAX];	/* auto-off, if enabled */
+    struct light_writer *backlight_writer;
+    int route;			/* enum light_route */
+    int scale[LIGHT_PANEL_MAX];	/* permille, [0] is the primary panel */
+    int nr_panels;
+    struct light_panel panels[LIGHT_PANEL_MAX - 1];
 } *context;
 
-static int get_max_brightness()
+/*
+ * Static description of a light: where it lives in sysfs, how a
+ * light_state_t maps to its brightness and which of the optional
+ * behaviours (coalescing, flashing, auto-off) it uses. Adding a light is
+ * adding an entry to light_descs[].
+ */
+struct light_desc {
+    const char *id;
+    enum light_type type;
+    const char *class_name;	/* sysfs class to search */
+    const char *const *names;	/* device names, best first; NULL: any */
+    const char *legacy_dir;
+    unsigned char (*to_brightness)(const struct light_state_t *state);
+    int (*set_light)(struct light_device_t *dev,
+                     const struct light_state_t *state);
+    int (*set_light_ramp)(struct light_device_ext_t *dev,
+                          const struct light_state_t *state,
+                          int duration_ms, int curve);
+    int (*set_light_level)(struct light_device_ext_t *dev, unsigned int level,
+                           int duration_ms, int curve);
+    int coalesce;
+    int blink;		/* honours flashMode */
+    int rgb;		/* may be a light_rgb, colour is kept */
+    struct light_info *auto_off;
+};
+
+/* what open_lights() hands out */
+struct lights_device {
+    struct light_device_ext_t ext;
+    const struct light_desc *desc;
+};
+
+static inline const struct light_desc *
+lights_device_desc(const struct light_device_t *dev)
 {
-    char tmp_s[8];
+    return ((const struct lights_device *)dev)->desc;
+}
+
+static int read_max_brightness(struct light_node *node, const char *path)
+{
+    char tmp_s[16];
     int fd, value, ret;
-    char *path = LIGHT_ID_MAX_BACKLIGHT_PATH;
 
+    stats_inc(node->syscalls);
     fd = open(path, O_RDONLY);
     if (fd < 0) {
-            LOGE("faild to open %s, ret = %d\n", path, errno);
-            return -errno;
+            /* legacy nodes have none: the caller falls back and tells */
+            ret = -errno;
+            LIGHTS_LOGD("faild to open %s, ret = %d\n", path, -ret);
+            return ret;
     }
 
-    ret = read(fd, &tmp_s[0], sizeof(tmp_s));
+    stats_inc(node->syscalls);
+    ret = read(fd, &tmp_s[0], sizeof(tmp_s) - 1);
     if (ret < 0) {
+	    ret = -errno;
+	    stats_inc(node->syscalls);
 	    close(fd);
 	    return ret;
     }
+    tmp_s[ret] = '\0';
 
     value = atoi(&tmp_s[0]);
 
+    stats_inc(node->syscalls);
     close(fd);
 
     return value;
 }
 
-static int write_brightness(int fd, unsigned char brightness)
+/*
+ * Legacy class devices (keyboard-backlight, battery-backlight, ...) do not
+ * always export max_brightness; scale those against the panel as before.
+ */
+static int lights_node_load_max(struct light_node *node)
 {
-    char buff[32];
-    int intensity;
-    int bytes, ret, max_br;
+    const char *panel_max = light_locations[LIGHT_TYPE_BACKLIGHT].max_path;
+    int max_br;
+
+    max_br = read_max_brightness(node, node->max_path);
+    if (max_br <= 0 && strcmp(node->max_path, panel_max))
+        max_br = read_max_brightness(node, panel_max);
+    if (max_br <= 0) {
+        LIGHTS_LOGE("fail to read max brightness for %s\n", node->path);
+        return max_br < 0 ? max_br : -EINVAL;
+    }
 
-    max_br = get_max_brightness(); 
+    node->max_brightness = max_br;
+    return 0;
+}
 
-    if(max_br < 0){
-        LOGE("fail to read max brightness\n");
-        return -1;
+/* curve: perceptual position p in [0, 1] to linear light output */
+static float lights_curve_to_linear(int curve, float p)
+{
+    switch (curve) {
+    case LIGHT_CURVE_GAMMA:
+        return powf(p, LIGHT_CURVE_GAMMA_EXP);
+    case LIGHT_CURVE_CIE:
+        /* CIE 1931 lightness, L* = 100 p, to relative luminance */
+        p *= 100.0f;
+        if (p <= 8.0f)
+            return p / 903.3f;
+        p = (p + 16.0f) / 116.0f;
+        return p * p * p;
+    default:
+        return p;
+    }
+}
+
+static float lights_curve_from_linear(int curve, float y)
+{
+    switch (curve) {
+    case LIGHT_CURVE_GAMMA:
+        return powf(y, 1.0f / LIGHT_CURVE_GAMMA_EXP);
+    case LIGHT_CURVE_CIE:
+        if (y <= 0.008856f)
+            return y * 903.3f / 100.0f;
+        return (116.0f * cbrtf(y) - 16.0f) / 100.0f;
+    default:
+        return y;
     }
+}
 
-    bright_to_intensity(max_br, brightness, intensity);
+/* "b:permille,..." with b strictly increasing, anchored at 0:0, 255:1000 */
+static int lights_curve_parse_points(struct light_curve_map *map,
+                                     const char *s)
+{
+    char *end;
+    long in, out;
+    int n = 1;
+
+    map->in[0] = 0;
+    map->out[0] = 0;
+    while (*s) {
+        in = strtol(s, &end, 10);
+        if (end == s || *end != ':')
+            return -EINVAL;
+        s = end + 1;
+        out = strtol(s, &end, 10);
+        if (end == s || (*end && *end != ','))
+            return -EINVAL;
+        s = *end ? end + 1 : end;
+
+        if (in < 0 || in > BRIGHT_MAX_BAR || out < 0 || out > 1000)
+            return -EINVAL;
+        if (in == 0 && n == 1) {
+            map->out[0] = out;
+            continue;
+        }
+        if (in <= map->in[n - 1] || n > LIGHT_CURVE_POINTS_MAX)
+            return -EINVAL;
+        map->in[n] = in;
+        map->out[n] = out;
+        n++;
+    }
+    if (map->in[n - 1] != BRIGHT_MAX_BAR) {
+        map->in[n] = BRIGHT_MAX_BAR;
+        map->out[n] = 1000;
+        n++;
+    }
 
-    bytes = snprintf(buff, sizeof(buff), "%d\n", intensity);
-    if (bytes < 0)
-	    return bytes;
+    return map->nr_points = n;
+}
 
-    ret = write(fd, buff, bytes);
-    if (ret < 0) {
-        LOGE("faild to write %d (fd = %d, errno = %d)\n",
-             intensity, fd, errno);
-        return -errno;
+static void lights_curve_load(struct light_curve_map *map, const char *id)
+{
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+
+    memset(map, 0, sizeof(*map));
+    map->curve = LIGHT_CURVE_LINEAR;
+
+    snprintf(key, sizeof(key), LIGHT_PROP_CURVE, id);
+    property_get(key, value, "linear");
+    if (!strcmp(value, "gamma"))
+        map->curve = LIGHT_CURVE_GAMMA;
+    else if (!strcmp(value, "cie"))
+        map->curve = LIGHT_CURVE_CIE;
+    else if (strcmp(value, "linear"))
+        LIGHTS_LOGE("%s: unknown curve %s, using linear\n", id, value);
+
+    snprintf(key, sizeof(key), LIGHT_PROP_POINTS, id);
+    if (property_get(key, value, "") > 0
+        && lights_curve_parse_points(map, value) < 0) {
+        LIGHTS_LOGE("%s: bad breakpoints \"%s\", ignored\n", id, value);
+        map->nr_points = 0;
     }
 
-    return 0;
+    snprintf(key, sizeof(key), LIGHT_PROP_FLOOR, id);
+    property_get(key, value, "0");
+    map->floor = atoi(value);
 }
 
-static inline int __is_on(const struct light_state_t *state)
+/*
+ * level is 0..LIGHT_LEVEL_MAX; an 8-bit brightness b is level b * 257, so
+ * both APIs share one curve and agree wherever they overlap.
+ */
+#define brightness_to_level(__br)   ((__br) * (LIGHT_LEVEL_MAX / BRIGHT_MAX_BAR))
+
+static int lights_curve_map(const struct light_curve_map *map,
+                            unsigned int level, int max)
 {
-    return state->color & 0x00ffffff;
+    int i, intensity;
+    float y;
+
+    if (map->nr_points) {
+        for (i = 1; level > brightness_to_level(map->in[i]); i++)
+            ;
+        y = map->out[i - 1] + (float)(map->out[i] - map->out[i - 1])
+            * (level - brightness_to_level(map->in[i - 1]))
+            / brightness_to_level(map->in[i] - map->in[i - 1]);
+        intensity = (int)(y * max / 1000 + 0.5f);
+    } else if (map->curve == LIGHT_CURVE_LINEAR) {
+        /* integer math, exactly what this HAL always wrote */
+        intensity = (long long)max * level / LIGHT_LEVEL_MAX;
+    } else {
+        y = lights_curve_to_linear(map->curve,
+                                   (float)level / LIGHT_LEVEL_MAX);
+        intensity = (int)(y * max + 0.5f);
+    }
+
+    if (level && intensity < map->floor)
+        intensity = map->floor;
+    if (intensity > max)
+        intensity = max;
+
+    return intensity;
 }
 
-static inline unsigned char
-__rgb_to_brightness(const struct light_state_t *state)
+/*
+ * Encode every brightness the framework can ask for once, so the write
+ * path is a table lookup and a pwrite().
+ */
+static void lights_node_build_table(struct light_node *node)
 {
-    int color = state->color & 0x00ffffff;
-    unsigned char brightness = ((77 * ((color >> 16) & 0x00ff))
-                                + (150 * ((color >> 8) & 0x00ff))
-                                + (29 * (color & 0x00ff))) >> 8;
-    return brightness;
+    int i, intensity;
+
+    lights_curve_load(&node->curve, node->id);
+    for (i = 0; i <= BRIGHT_MAX_BAR; i++) {
+        intensity = lights_curve_map(&node->curve, brightness_to_level(i),
+                                     node->max_brightness);
+        node->intensity[i] = intensity;
+        node->lengths[i] = snprintf(node->strings[i], LIGHT_INTENSITY_STR,
+                                    "%d\n", intensity);
+    }
 }
 
-static int
-set_light_backlight(struct light_device_t *dev,
-                    const struct light_state_t *state)
+static int lights_node_open(struct light_node *node, const char *path,
+                            const char *max_path)
 {
-    int brightness = __rgb_to_brightness(state);
+    int ret;
+
+    node->path = path;
+    node->max_path = max_path;
+    node->last_intensity = -1;
+    node->triggers = -1;
+
+    stats_inc(node->syscalls);
+    node->fd = open(path, O_RDWR);
+    if (node->fd < 0) {
+        LIGHTS_LOGE_RL("faild to open %s, ret = %d\n", path, errno);
+        return -errno;
+    }
+
+    ret = lights_node_load_max(node);
+    if (ret < 0) {
+        stats_inc(node->syscalls);
+        close(node->fd);
+        node->fd = -1;
+        return ret;
+    }
+
+    lights_node_build_table(node);
+
+    LIGHTS_LOGD("opened %s, fd = %d, max = %d\n", path, node->fd,
+         node->max_brightness);
 
-    return write_brightness(context->fds.backlight, brightness);
+    return 0;
 }
 
-static int set_light_keyboard(struct light_device_t *dev,
-                              const struct light_state_t *state)
+/*
+ * A write to an attribute of an unbound device fails with ENODEV; that is
+ * our notification that the driver was re-probed. Reopen the attribute
+ * and pick up the (possibly different) max_brightness of the new instance.
+ */
+static int lights_node_reprobe(struct light_node *node)
 {
-    int on = __is_on(state);
+    LIGHTS_LOGD("%s re-probed, reloading\n", node->path);
+
+    if (node->fd >= 0) {
+        stats_inc(node->syscalls);
+        close(node->fd);
+        node->fd = -1;
+    }
 
-    return write_brightness(context->fds.keyboard,
-                            on ? LIGHT_LED_FULL : LIGHT_LED_OFF);
+    return lights_node_open(node, node->path, node->max_path);
 }
 
-static int set_light_buttons(struct light_device_t *dev,
-                             const struct light_state_t *state)
+/*
+ * Always at offset 0: the fd is kept open for the life of the HAL and
+ * some attributes refuse a write at a non-zero position.
+ */
+static int lights_node_write(struct light_node *node, const char *buf,
+                             int len, int intensity)
 {
-    int on = __is_on(state);
+    struct timespec start, end;
+    unsigned long us;
+    int ret = 0, bucket;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stats_inc(node->syscalls);
+    if (pwrite(node->fd, buf, len, 0) < 0)
+        ret = -errno;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    us = (end.tv_sec - start.tv_sec) * 1000000
+         + (end.tv_nsec - start.tv_nsec) / 1000;
+    bucket = us ? 32 - __builtin_clz(us) : 0;
+    if (bucket >= LIGHT_STATS_BUCKETS)
+        bucket = LIGHT_STATS_BUCKETS - 1;
+    stats_inc(node->stats.writes);
+    stats_inc(node->stats.latency[bucket]);
 
-#ifdef LIGHT_BUTTONS_AUTO_POWEROFF
-    if (!pthread_mutex_lock(&context->button_info->lock)) {
-	    context->button_info->brightness = on ? LIGHT_LED_FULL : LIGHT_LED_OFF;
-	    context->button_info->need_update = 1;
-	    if (pthread_cond_signal(&context->button_info->cond))
-		    LOGE("Error: <%s>: pthread_cond_signal\n", __func__);
-	    if (pthread_mutex_unlock(&context->button_info->lock)) {
-		    LOGE("Error: <%s>: pthread_mutex_unlock\n", __func__);
-		    return -1;
-	    }
-    } else {
-	    LOGE("Error: <%s>: pthread_mutex_lock\n", __func__);
-	    return -1;
+    if (ret < 0) {
+        LIGHTS_LOGE_RL("faild to write %d (fd = %d, errno = %d)\n",
+             intensity, node->fd, -ret);
+        stats_inc(node->stats.errors[-ret < LIGHT_STATS_ERRNO_MAX ? -ret : 0]);
+        node->last_intensity = -1;
+        return ret;
     }
+    node->last_intensity = intensity;
 
     return 0;
-#else
-    return write_brightness(context->fds.buttons,
-			on ? LIGHT_LED_FULL : LIGHT_LED_OFF);
-#endif
 }
 
-static int set_light_battery(struct light_device_t *dev,
-                             const struct light_state_t *state)
+/* any value on the hardware scale, for ramps */
+static int write_intensity(struct light_node *node, int intensity)
 {
-    int on = __is_on(state);
+    char buff[LIGHT_INTENSITY_STR];
+    int bytes, ret, retried = 0;
+
+    if (node->fd < 0)
+        return -ENODEV;
+
+retry:
+    if (intensity > node->max_brightness)
+        intensity = node->max_brightness;
+    if (node->coalesce && intensity == node->last_intensity) {
+        stats_inc(node->stats.coalesced);
+        return 0;
+    }
+
+    bytes = snprintf(buff, sizeof(buff), "%d\n", intensity);
+    if (bytes < 0)
+	    return bytes;
+
+    ret = lights_node_write(node, buff, bytes, intensity);
+    if (ret == -ENODEV && !retried++ && !lights_node_reprobe(node))
+        goto retry;
 
-    return write_brightness(context->fds.battery,
-                            on ? LIGHT_LED_FULL : LIGHT_LED_OFF);
+    return ret;
 }
 
-static int set_light_notifications(struct light_device_t *dev,
-                                   const struct light_state_t *state)
+static int write_brightness(struct light_node *node, unsigned char brightness)
 {
-    int on = __is_on(state);
+    int ret, retried = 0;
+
+    if (node->fd < 0)
+        return -ENODEV;
+
+retry:
+    if (node->coalesce && node->intensity[brightness] == node->last_intensity) {
+        stats_inc(node->stats.coalesced);
+        return 0;
+    }
+
+    ret = lights_node_write(node, node->strings[brightness],
+                            node->lengths[brightness],
+                            node->intensity[brightness]);
+    /* the table is rebuilt for the new max_brightness by the re-probe */
+    if (ret == -ENODEV && !retried++ && !lights_node_reprobe(node))
+        goto retry;
 
-    return write_brightness(context->fds.notifications,
-                            on ? LIGHT_LED_FULL : LIGHT_LED_OFF);
+    return ret;
 }
 
-static int set_light_attention(struct light_device_t *dev,
-                               const struct light_state_t *state)
+/* forget what every node was last written with so the next set_light()
+ * reaches the hardware even if the value did not change */
+static void lights_invalidate(struct lights_ctx *ctx)
 {
-    int on = __is_on(state);
+    int i;
 
-    return write_brightness(context->fds.attention,
-                            on ? LIGHT_LED_FULL : LIGHT_LED_OFF);
+    for (i = 0; i < LIGHT_TYPE_MAX; i++)
+        ctx->nodes[i].last_intensity = -1;
+    for (i = 0; i < LIGHT_CHANNEL_MAX; i++)
+        ctx->rgb.channels[i].last_intensity = -1;
+    for (i = 0; i < ctx->nr_panels; i++)
+        ctx->panels[i].node.last_intensity = -1;
 }
 
-/* lights close method */
-static int close_lights_dev(struct light_device_t *dev)
+static long elapsed_ms(const struct timespec *start)
 {
-    if (dev)
-        free(dev);
+    struct timespec now;
 
-    return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000
+           + (now.tv_nsec - start->tv_nsec) / 1000000;
 }
 
-static void *lights_events_thread(void *arg)
+static int atomic_swap(volatile int *ptr, int value)
 {
-	struct light_info *info = arg;
-	int i, j;
-	fd_set rfds;
-	struct input_event event;
-	int need_wake;
-	int ret;
-	int max_fd;
+	int old;
 
-	FD_ZERO(&rfds);
-	for (;;) {
-		need_wake = 0;
-		for (i = 0; i < WAKE_EVENT_MAX && info->events[i].file; i ++)
-			FD_SET(info->events[i].fd, &rfds);
+	do {
+		old = *ptr;
+	} while (!__sync_bool_compare_and_swap(ptr, old, value));
 
-		if (i == 0)
-			return NULL;
+	return old;
+}
 
-		max_fd = info->events[i-1].fd;
+static int lights_ramp_value(const struct light_ramp *ramp, long elapsed)
+{
+    float p;
 
-		ret = select(max_fd + 1, &rfds, NULL, NULL, NULL);
-		if (ret < 0) {
-			if (ret == -EINTR)
-				continue;
-			LOGE("<%s>: fatal bug, select file error\n", info->name);
-			return NULL;
-		}
-		for (i = 0; i < WAKE_EVENT_MAX && info->events[i].file; i ++) {
-			if (!FD_ISSET(info->events[i].fd, &rfds))
-				continue;
-			while (read(info->events[i].fd, &event, sizeof(event)) == sizeof(event)) {
-				if (need_wake)
-					continue;
-				if(event.type == info->events[i].type) {
-					if (event.type == EV_ABS)
-						need_wake = 1;
-					else if (event.type == EV_KEY) {
-						for (j = 0; j < WAKE_KEY_MAX && info->events[i].key[j] != -1; j ++) {
-							if (info->events[i].key[j] == KEY_ANY
-									|| info->events[i].key[j] == event.code) {
-								LOGD("<%s>: EV_KEY wake up\n", info->name);
-								need_wake = 1;
-								break;
-							}
-						}
-					}
-				}
-			}
-		}
-		if (need_wake) {
-			if (!pthread_mutex_lock(&info->lock)) {
-				info->need_update = 1;
-				if (pthread_cond_signal(&info->cond))
-					LOGE("Error: <%s>: pthread_cond_signal\n", __func__);
-				if (pthread_mutex_unlock(&info->lock)) {
-					LOGE("Error: <%s>: pthread_mutex_unlock\n", __func__);
-					return NULL;
-				}
-			} else {
-				LOGE("Error: <%s>: pthread_mutex_lock\n", __func__);
-				return NULL;
-			}
-		}
-	}
+    if (elapsed >= ramp->duration_ms)
+        return ramp->to;
 
-	return NULL;
+    p = ramp->p_from + (ramp->p_to - ramp->p_from) * elapsed / ramp->duration_ms;
+    return (int)(lights_curve_to_linear(ramp->curve, p) * ramp->max + 0.5f);
 }
 
-static void *lights_update_thread(void *arg)
+/*
+ * Sleep ms between two ramp steps, waking up as soon as a value or a new
+ * ramp is posted; cond runs on CLOCK_MONOTONIC. Returns 1 if one was.
+ */
+static int lights_writer_sleep(struct light_writer *writer, long ms)
+{
+	struct timespec deadline;
+	int posted;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += ms / 1000;
+	deadline.tv_nsec += (ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	if (pthread_mutex_lock(&writer->lock)) {
+		LIGHTS_LOGE_RL("Error: <%s>: pthread_mutex_lock\n", __func__);
+		return 1;
+	}
+	for (;;) {
+		posted = writer->pending != -1 || writer->ramp_pending;
+		/* 0: signalled (or spurious), look again */
+		if (posted || pthread_cond_timedwait(&writer->cond, &writer->lock,
+		                                     &deadline))
+			break;
+	}
+	if (pthread_mutex_unlock(&writer->lock))
+		LIGHTS_LOGE_RL("Error: <%s>: pthread_mutex_unlock\n", __func__);
+
+	return posted;
+}
+
+/*
+ * Step from the current intensity to ramp->to. The step period is the
+ * one that visits every hardware level of a linear ramp, bounded below
+ * by LIGHT_RAMP_MIN_STEP_MS; levels a step would repeat are coalesced
+ * by write_intensity(). Returns early when a newer request is posted.
+ */
+static void lights_writer_ramp(struct light_writer *writer,
+                               struct light_ramp *ramp)
+{
+	struct light_node *node = writer->node;
+	long elapsed, step_ms;
+	int delta;
+
+	ramp->max = node->max_brightness;
+	ramp->from = node->last_intensity;
+	if (ramp->from < 0 || ramp->duration_ms <= 0) {
+		write_intensity(node, ramp->to);
+		return;
+	}
+	ramp->p_from = lights_curve_from_linear(ramp->curve,
+	                                        (float)ramp->from / ramp->max);
+	ramp->p_to = lights_curve_from_linear(ramp->curve,
+	                                      (float)ramp->to / ramp->max);
+
+	delta = abs(ramp->to - ramp->from);
+	if (!delta)
+		return;
+	step_ms = ramp->duration_ms / delta;
+	if (step_ms < LIGHT_RAMP_MIN_STEP_MS)
+		step_ms = LIGHT_RAMP_MIN_STEP_MS;
+
+	clock_gettime(CLOCK_MONOTONIC, &ramp->start);
+	for (;;) {
+		elapsed = elapsed_ms(&ramp->start);
+		write_intensity(node, lights_ramp_value(ramp, elapsed));
+		if (elapsed >= ramp->duration_ms)
+			return;
+		if (lights_writer_sleep(writer, step_ms))
+			return;
+	}
+}
+
+static void *lights_writer_thread(void *arg)
+{
+	struct light_writer *writer = arg;
+	struct light_ramp ramp;
+	int brightness, has_ramp;
+
+	for (;;) {
+		/* wait for a value or a ramp to be posted */
+		if (!pthread_mutex_lock(&writer->lock)) {
+			while (writer->pending == -1 && !writer->ramp_pending) {
+				if (pthread_cond_wait(&writer->cond, &writer->lock))
+					LIGHTS_LOGE_RL("Error: <%s>: pthread_cond_wait\n", __func__);
+			}
+			has_ramp = writer->ramp_pending;
+			if (has_ramp) {
+				ramp = writer->ramp;
+				writer->ramp_pending = 0;
+			}
+			if (pthread_mutex_unlock(&writer->lock)) {
+				LIGHTS_LOGE_RL("Error: <%s>: pthread_mutex_unlock\n", __func__);
+				return NULL;
+			}
+		} else {
+			LIGHTS_LOGE_RL("Error: <%s>: pthread_mutex_lock\n", __func__);
+			return NULL;
+		}
+
+		/*
+		 * The write runs unlocked so posters never wait for it. A
+		 * value posted after the ramp cancels it; one posted before
+		 * was already cleared by lights_writer_post_ramp().
+		 */
+		brightness = atomic_swap(&writer->pending, -1);
+		if (brightness != -1)
+			write_brightness(writer->node, brightness);
+		else if (has_ramp)
+			lights_writer_ramp(writer, &ramp);
+	}
+
+	return NULL;
+}
+
+static int lights_writer_wake(struct light_writer *writer)
+{
+	if (!pthread_mutex_lock(&writer->lock)) {
+		if (pthread_cond_signal(&writer->cond))
+			LIGHTS_LOGE_RL("Error: <%s>: pthread_cond_signal\n", __func__);
+		if (pthread_mutex_unlock(&writer->lock)) {
+			LIGHTS_LOGE_RL("Error: <%s>: pthread_mutex_unlock\n", __func__);
+			return -1;
+		}
+	} else {
+		LIGHTS_LOGE_RL("Error: <%s>: pthread_mutex_lock\n", __func__);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int lights_writer_post(struct light_writer *writer,
+                              unsigned char brightness)
+{
+	/*
+	 * Replace whatever is still pending. If something was, the writer
+	 * has already been (or is about to be) woken up for it and will pick
+	 * up this value instead.
+	 */
+	if (atomic_swap(&writer->pending, brightness) != -1)
+		return 0;
+
+	return lights_writer_wake(writer);
+}
+
+static int lights_writer_post_ramp(struct light_writer *writer, int intensity,
+                                   int duration_ms, int curve)
+{
+	/* a ramp supersedes any jump that has not been written yet */
+	atomic_swap(&writer->pending, -1);
+
+	if (!pthread_mutex_lock(&writer->lock)) {
+		writer->ramp.to = intensity;
+		writer->ramp.duration_ms = duration_ms;
+		writer->ramp.curve = curve;
+		writer->ramp_pending = 1;
+		if (pthread_cond_signal(&writer->cond))
+			LIGHTS_LOGE_RL("Error: <%s>: pthread_cond_signal\n", __func__);
+		if (pthread_mutex_unlock(&writer->lock)) {
+			LIGHTS_LOGE_RL("Error: <%s>: pthread_mutex_unlock\n", __func__);
+			return -1;
+		}
+	} else {
+		LIGHTS_LOGE_RL("Error: <%s>: pthread_mutex_lock\n", __func__);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int lights_init_writer(struct light_writer *writer,
+                              struct light_node *node)
+{
+    pthread_condattr_t attr;
+    pthread_t tid;
+    int ret;
+
+    writer->node = node;
+    if (pthread_mutex_init(&writer->lock, NULL))
+	    return -1;
+    /* ramp steps time out against CLOCK_MONOTONIC, see lights_writer_sleep() */
+    if (pthread_condattr_init(&attr))
+	    return -1;
+    ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)
+          || pthread_cond_init(&writer->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (ret)
+	    return -1;
+    if (pthread_create(&tid, NULL, lights_writer_thread, writer)) {
+	    LIGHTS_LOGE("<%s>: failed to start thread\n", writer->name);
+	    return -1;
+    }
+
+    return 0;
+}
+
+/* the writer is started at open in async mode, else by the first ramp */
+static struct light_writer *lights_get_writer(struct lights_ctx *ctx)
+{
+    static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    if (ctx->backlight_writer)
+        return ctx->backlight_writer;
+
+    pthread_mutex_lock(&init_lock);
+    if (!ctx->backlight_writer
+        && !lights_init_writer(&backlight_writer,
+                               &ctx->nodes[LIGHT_TYPE_BACKLIGHT])) {
+        __sync_synchronize();
+        ctx->backlight_writer = &backlight_writer;
+    }
+    pthread_mutex_unlock(&init_lock);
+
+    return ctx->backlight_writer;
+}
+
+/* path of another attribute in the class directory of node */
+static int lights_node_attr(const struct light_node *node, const char *attr,
+                            char *buf, size_t size)
+{
+    const char *slash = strrchr(node->path, '/');
+    int len;
+
+    if (!slash)
+        return -EINVAL;
+
+    len = snprintf(buf, size, "%.*s/%s", (int)(slash - node->path),
+                   node->path, attr);
+    if (len < 0 || (size_t)len >= size)
+        return -ENAMETOOLONG;
+
+    return 0;
+}
+
+static int write_attr(struct light_node *node, const char *attr,
+                      const char *value)
+{
+    char path[PATH_MAX];
+    int fd, ret;
+
+    ret = lights_node_attr(node, attr, path, sizeof(path));
+    if (ret < 0)
+        return ret;
+
+    stats_inc(node->syscalls);
+    fd = open(path, O_WRONLY);
+    if (fd < 0)
+        return -errno;
+
+    stats_inc(node->syscalls);
+    ret = write(fd, value, strlen(value));
+    ret = ret < 0 ? -errno : 0;
+
+    stats_inc(node->syscalls);
+    close(fd);
+
+    return ret;
+}
+
+static int write_attr_int(struct light_node *node, const char *attr, int value)
+{
+    char buff[16];
+
+    snprintf(buff, sizeof(buff), "%d\n", value);
+    return write_attr(node, attr, buff);
+}
+
+/* which of the triggers we use does the LED class device offer? cached */
+static int lights_node_triggers(struct light_node *node)
+{
+    char path[PATH_MAX], buff[512];
+    char *name, *save;
+    int fd, ret;
+
+    if (node->triggers >= 0)
+        return node->triggers;
+
+    node->triggers = 0;
+    if (lights_node_attr(node, "trigger", path, sizeof(path)))
+        return 0;
+
+    stats_inc(node->syscalls);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    stats_inc(node->syscalls);
+    ret = read(fd, buff, sizeof(buff) - 1);
+    stats_inc(node->syscalls);
+    close(fd);
+    if (ret <= 0)
+        return 0;
+    buff[ret] = '\0';
+
+    /* the list looks like "[none] timer heartbeat pattern ..." */
+    for (name = strtok_r(buff, " []\n", &save); name;
+         name = strtok_r(NULL, " []\n", &save)) {
+        if (!strcmp(name, "timer"))
+            node->triggers |= LIGHT_TRIGGER_TIMER;
+        else if (!strcmp(name, "pattern"))
+            node->triggers |= LIGHT_TRIGGER_PATTERN;
+    }
+
+    LIGHTS_LOGD("%s: triggers%s%s\n", node->path,
+         node->triggers & LIGHT_TRIGGER_TIMER ? " timer" : "",
+         node->triggers & LIGHT_TRIGGER_PATTERN ? " pattern" : "");
+    return node->triggers;
+}
+
+static void lights_info_update(struct light_info *info);
+static unsigned int lights_info_post(struct light_info *info, int brightness);
+static void lights_info_stash(struct light_info *info, int brightness);
+
+static void *lights_loop_thread(void *arg)
+{
+	struct lights_loop *loop = arg;
+	struct epoll_event ready[LIGHTS_LOOP_BATCH];
+	struct lights_watch *watch;
+	int i, n;
+
+	for (;;) {
+		n = epoll_wait(loop->epoll_fd, ready, LIGHTS_LOOP_BATCH, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			LIGHTS_LOGE("fatal bug, epoll_wait error %d\n", errno);
+			return NULL;
+		}
+		for (i = 0; i < n; i ++) {
+			watch = ready[i].data.ptr;
+			watch->events = ready[i].events;
+			watch->handler(watch);
+		}
+	}
+
+	return NULL;
+}
+
+/* set_light() posted something: let every auto-off light catch up */
+static void lights_loop_request(struct lights_watch *watch)
+{
+	struct lights_loop *loop = container_of(watch, struct lights_loop, request);
+	uint64_t count;
+	int i;
+
+	if (read(watch->fd, &count, sizeof(count)) < 0)
+		return;
+
+	for (i = 0; i < loop->nr_infos; i ++)
+		lights_info_update(loop->infos[i]);
+}
+
+static int lights_loop_add(struct lights_loop *loop, struct lights_watch *watch)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = watch;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, watch->fd, &ev)) {
+		LIGHTS_LOGE("Error: <%s>: epoll_ctl fd %d, errno = %d\n",
+			    __func__, watch->fd, errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int lights_loop_kick(struct lights_loop *loop)
+{
+	uint64_t one = 1;
+
+	if (write(loop->request.fd, &one, sizeof(one)) < 0) {
+		LIGHTS_LOGE_RL("Error: <%s>: write eventfd, errno = %d\n", __func__, errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* create the loop and its thread the first time a light needs them */
+static int lights_loop_start(struct lights_loop *loop)
 {
-	struct light_info *info = arg;
-	struct timespec ts;
 	pthread_t tid;
+	int ret = 0;
+
+	pthread_mutex_lock(&loop->lock);
+	if (loop->epoll_fd >= 0)
+		goto out;
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		ret = -errno;
+		LIGHTS_LOGE("Error: <%s>: epoll_create1, errno = %d\n", __func__, errno);
+		goto out;
+	}
+	loop->request.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	loop->request.handler = lights_loop_request;
+	if (loop->request.fd < 0 || lights_loop_add(loop, &loop->request)
+	    || pthread_create(&tid, NULL, lights_loop_thread, loop)) {
+		LIGHTS_LOGE("Error: <%s>: failed to start event loop\n", __func__);
+		if (loop->request.fd >= 0)
+			close(loop->request.fd);
+		close(loop->epoll_fd);
+		loop->request.fd = -1;
+		loop->epoll_fd = -1;
+		ret = -EAGAIN;
+	}
+
+out:
+	pthread_mutex_unlock(&loop->lock);
+	return ret;
+}
+
+static int lights_loop_register(struct lights_loop *loop, struct light_info *info)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&loop->lock);
+	if (loop->nr_infos < LIGHTS_LOOP_INFO_MAX) {
+		loop->infos[loop->nr_infos] = info;
+		__sync_synchronize();
+		loop->nr_infos++;
+	} else {
+		ret = -ENOSPC;
+	}
+	pthread_mutex_unlock(&loop->lock);
+
+	return ret ? ret : lights_loop_kick(loop);
+}
+
+/*
+ * Write colour (0x00rrggbb) to every channel of rgb, as one update that
+ * set_light() and the blink scheduler don't interleave. The white channel,
+ * if any, takes the grey part all three colours share. Channels that keep
+ * their value are skipped by the coalescing in write_brightness().
+ */
+static int lights_rgb_write(struct light_rgb *rgb, unsigned int color)
+{
+    int value[LIGHT_CHANNEL_MAX];
+    int i, white, err, ret = 0;
+
+    value[LIGHT_CHANNEL_RED] = (color >> 16) & 0xff;
+    value[LIGHT_CHANNEL_GREEN] = (color >> 8) & 0xff;
+    value[LIGHT_CHANNEL_BLUE] = color & 0xff;
+    value[LIGHT_CHANNEL_WHITE] = 0;
+    if (rgb->channels[LIGHT_CHANNEL_WHITE].fd >= 0) {
+        white = value[LIGHT_CHANNEL_RED];
+        for (i = LIGHT_CHANNEL_GREEN; i <= LIGHT_CHANNEL_BLUE; i++)
+            if (value[i] < white)
+                white = value[i];
+        for (i = LIGHT_CHANNEL_RED; i <= LIGHT_CHANNEL_BLUE; i++)
+            value[i] -= white;
+        value[LIGHT_CHANNEL_WHITE] = white;
+    }
+
+    pthread_mutex_lock(&rgb->lock);
+    for (i = 0; i < LIGHT_CHANNEL_MAX; i++) {
+        if (rgb->channels[i].fd < 0)
+            continue;
+        err = write_brightness(&rgb->channels[i],
+                               value[i] * rgb->balance[i] / 1000);
+        if (err)
+            ret = err;
+    }
+    pthread_mutex_unlock(&rgb->lock);
+
+    return ret;
+}
+
+static inline int ts_before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec
+           || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static inline void ts_add_ms(struct timespec *ts, int ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static inline long ts_ms_until(const struct timespec *now,
+                               const struct timespec *ts)
+{
+    return (ts->tv_sec - now->tv_sec) * 1000
+           + (ts->tv_nsec - now->tv_nsec) / 1000000;
+}
+
+static void heap_swap(struct light_scheduler *s, int a, int b)
+{
+    struct light_blink *tmp = s->heap[a];
+
+    s->heap[a] = s->heap[b];
+    s->heap[b] = tmp;
+    s->heap[a]->index = a;
+    s->heap[b]->index = b;
+}
+
+static void heap_fix(struct light_scheduler *s, int i)
+{
+    int child;
+
+    while (i > 0 && ts_before(&s->heap[i]->deadline,
+                              &s->heap[(i - 1) / 2]->deadline)) {
+        heap_swap(s, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= s->count)
+            break;
+        if (child + 1 < s->count
+            && ts_before(&s->heap[child + 1]->deadline, &s->heap[child]->deadline))
+            child++;
+        if (!ts_before(&s->heap[child]->deadline, &s->heap[i]->deadline))
+            break;
+        heap_swap(s, i, child);
+        i = child;
+    }
+}
+
+static void heap_push(struct light_scheduler *s, struct light_blink *blink)
+{
+    blink->index = s->count;
+    s->heap[s->count++] = blink;
+    heap_fix(s, blink->index);
+}
+
+static void heap_remove(struct light_scheduler *s, struct light_blink *blink)
+{
+    int i = blink->index;
+
+    blink->index = -1;
+    if (--s->count == i)
+        return;
+    s->heap[i] = s->heap[s->count];
+    s->heap[i]->index = i;
+    heap_fix(s, i);
+}
+
+/* arm the timer for the earliest deadline, called with the lock held */
+static void lights_scheduler_arm(struct light_scheduler *s)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (s->count)
+        its.it_value = s->heap[0]->deadline;
+    if (timerfd_settime(s->timer.fd, TFD_TIMER_ABSTIME, &its, NULL))
+        LIGHTS_LOGE_RL("Error: <%s>: timerfd_settime, errno = %d\n", __func__, errno);
+}
+
+static int lights_phase_ms(const struct light_pattern_t *pattern,
+                           enum light_phase phase)
+{
+    switch (phase) {
+    case LIGHT_PHASE_RISE:
+        return pattern->rise_ms;
+    case LIGHT_PHASE_ON:
+        return pattern->on_ms;
+    case LIGHT_PHASE_FALL:
+        return pattern->fall_ms;
+    default:
+        return pattern->off_ms;
+    }
+}
+
+/* write the on level scaled by permille, per channel for rgb */
+static void lights_blink_write(struct light_blink *blink, int permille)
+{
+    unsigned int color = 0;
+    int shift;
+
+    if (!blink->rgb) {
+        write_intensity(blink->node, blink->level * permille / 1000);
+        return;
+    }
+    for (shift = 0; shift < 24; shift += 8)
+        color |= ((blink->color >> shift & 0xff) * permille / 1000) << shift;
+    lights_rgb_write(blink->rgb, color);
+}
+
+/*
+ * Bring blink up to now: move past the phases that are over, write the
+ * level it is at and set the deadline of its next step, which on a ramp
+ * is as soon as the level moves by one (but no sooner than
+ * LIGHT_PATTERN_STEP_MS). Returns 0 when the last repeat is done.
+ */
+static int lights_blink_advance(struct light_blink *blink,
+                                const struct timespec *now)
+{
+    long left;
+    int ms, step, permille;
+
+    while (!ts_before(now, &blink->phase_end)) {
+        if (blink->phase == LIGHT_PHASE_OFF && blink->repeat
+            && !--blink->repeat) {
+            lights_blink_write(blink, 0);
+            return 0;
+        }
+        blink->phase = (blink->phase + 1) % LIGHT_PHASE_MAX;
+        ms = lights_phase_ms(&blink->pattern, blink->phase);
+        ts_add_ms(&blink->phase_end, ms);
+        /* after a long stall, restart the phase instead of catching up */
+        if (ms && ts_before(&blink->phase_end, now)) {
+            blink->phase_end = *now;
+            ts_add_ms(&blink->phase_end, ms);
+        }
+    }
+
+    ms = lights_phase_ms(&blink->pattern, blink->phase);
+    left = ts_ms_until(now, &blink->phase_end);
+    blink->deadline = blink->phase_end;
+    switch (blink->phase) {
+    case LIGHT_PHASE_RISE:
+    case LIGHT_PHASE_FALL:
+        permille = 1000 * left / ms;
+        if (blink->phase == LIGHT_PHASE_RISE)
+            permille = 1000 - permille;
+        step = blink->level > 0 ? ms / blink->level : ms;
+        if (step < LIGHT_PATTERN_STEP_MS)
+            step = LIGHT_PATTERN_STEP_MS;
+        if (left > step) {
+            blink->deadline = *now;
+            ts_add_ms(&blink->deadline, step);
+        }
+        break;
+    case LIGHT_PHASE_ON:
+        permille = 1000;
+        break;
+    default:
+        permille = 0;
+        break;
+    }
+    lights_blink_write(blink, permille);
+
+    return 1;
+}
+
+static void lights_scheduler_expire(struct lights_watch *watch)
+{
+    struct light_scheduler *s = container_of(watch, struct light_scheduler, timer);
+    struct light_blink *blink;
+    struct timespec now;
+    uint64_t expirations;
+
+    /* EAGAIN: re-armed by set_light() since it fired, nothing due yet */
+    if (read(watch->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    if (pthread_mutex_lock(&s->lock)) {
+        LIGHTS_LOGE_RL("Error: <%s>: pthread_mutex_lock\n", __func__);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (s->count && !ts_before(&now, &s->heap[0]->deadline)) {
+        blink = s->heap[0];
+        if (lights_blink_advance(blink, &now))
+            heap_fix(s, 0);
+        else
+            heap_remove(s, blink);
+    }
+    lights_scheduler_arm(s);
+    if (pthread_mutex_unlock(&s->lock))
+        LIGHTS_LOGE_RL("Error: <%s>: pthread_mutex_unlock\n", __func__);
+}
+
+/* hook the scheduler into the event loop on first use, lock held */
+static int lights_scheduler_start(struct light_scheduler *s)
+{
+    int ret;
+
+    if (s->timer.fd >= 0)
+        return 0;
+
+    ret = lights_loop_start(&event_loop);
+    if (ret)
+        return ret;
+
+    s->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (s->timer.fd < 0) {
+        LIGHTS_LOGE("Error: <%s>: timerfd_create, errno = %d\n", __func__, errno);
+        return -errno;
+    }
+    s->timer.handler = lights_scheduler_expire;
+    ret = lights_loop_add(&event_loop, &s->timer);
+    if (ret) {
+        close(s->timer.fd);
+        s->timer.fd = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * The pattern trigger's "brightness duration" pairs for one period,
+ * "0 rise L on L fall 0 off": it interpolates between consecutive
+ * brightnesses, so a 0 duration makes a step.
+ */
+static int lights_pattern_compile(const struct light_pattern_t *pattern,
+                                  int level, char *buff, size_t size)
+{
+    int ret;
+
+    ret = snprintf(buff, size, "0 %d %d %d %d %d 0 %d\n", pattern->rise_ms,
+                   level, pattern->on_ms, level, pattern->fall_ms,
+                   pattern->off_ms);
+
+    return ret < 0 || (size_t)ret >= size ? -EINVAL : 0;
+}
+
+static int lights_blink_offload(struct light_blink *blink)
+{
+    struct light_node *node = blink->node;
+    const struct light_pattern_t *pattern = &blink->pattern;
+    int triggers = lights_node_triggers(node);
+    char buff[80];
+    int ret;
+
+    if (!pattern->rise_ms && !pattern->fall_ms && !pattern->repeat
+        && (triggers & LIGHT_TRIGGER_TIMER)) {
+        /* the timer trigger blinks at the brightness written before it */
+        ret = write_attr(node, "trigger", "timer")
+              || write_attr_int(node, "delay_on", pattern->on_ms)
+              || write_attr_int(node, "delay_off", pattern->off_ms);
+    } else if (triggers & LIGHT_TRIGGER_PATTERN) {
+        /* repeat first, writing the pattern is what starts it */
+        ret = lights_pattern_compile(pattern, blink->level, buff, sizeof(buff))
+              || write_attr(node, "trigger", "pattern")
+              || write_attr_int(node, "repeat",
+                                pattern->repeat ? pattern->repeat : -1)
+              || write_attr(node, "pattern", buff);
+    } else {
+        return -ENOSYS;
+    }
+
+    if (ret) {
+        write_attr(node, "trigger", "none");
+        node->last_intensity = -1;
+        return -EIO;
+    }
+
+    blink->offloaded = 1;
+    return 0;
+}
+
+/* the pattern of a set_light() flash: NULL for none */
+static const struct light_pattern_t *
+lights_state_pattern(const struct light_state_t *state,
+                     struct light_pattern_t *pattern)
+{
+    if (state->flashMode == LIGHT_FLASH_NONE
+        || state->flashOnMS <= 0 || state->flashOffMS <= 0)
+        return NULL;
+
+    memset(pattern, 0, sizeof(*pattern));
+    pattern->on_ms = state->flashOnMS;
+    pattern->off_ms = state->flashOffMS;
+
+    return pattern;
+}
+
+/*
+ * Apply brightness (color, for rgb) to the LED behind blink and run
+ * pattern on it if there is one: in the kernel when the LED class device
+ * has a trigger for it, on the scheduler otherwise. Called with s->lock
+ * held; sets *rearm when the heap changed and the scheduler timer has to
+ * be re-armed before the lock is dropped.
+ */
+static int lights_blink_update(struct light_scheduler *s,
+                               struct light_blink *blink,
+                               unsigned char brightness, unsigned int color,
+                               const struct light_pattern_t *pattern,
+                               int *rearm)
+{
+    struct light_node *node = blink->node;
+    struct timespec now;
+    int ret;
+
+    if (brightness == LIGHT_LED_OFF)
+        pattern = NULL;
+
+    /* unchanged endless pattern: leave it running in phase */
+    if (pattern && !pattern->repeat && (blink->offloaded || blink->index >= 0)
+        && blink->brightness == brightness
+        && !memcmp(&blink->pattern, pattern, sizeof(*pattern))
+        && (!blink->rgb || blink->color == color))
+        return 0;
+
+    if (blink->index >= 0) {
+        heap_remove(s, blink);
+        *rearm = 1;
+    }
+    if (blink->offloaded) {
+        write_attr(node, "trigger", "none");
+        node->last_intensity = -1;
+        blink->offloaded = 0;
+    }
+
+    /* a pattern that ramps up starts from off */
+    if (!pattern || !pattern->rise_ms) {
+        if (blink->rgb)
+            ret = lights_rgb_write(blink->rgb, brightness ? color : 0);
+        else
+            ret = write_brightness(node, brightness);
+        if (ret || !pattern)
+            return ret;
+    } else if (!blink->rgb && node->fd < 0) {
+        return -ENODEV;
+    }
+
+    blink->brightness = brightness;
+    blink->color = color;
+    blink->pattern = *pattern;
+    blink->level = blink->rgb ? LIGHT_LED_FULL : node->intensity[brightness];
+    /* per-channel triggers would drift apart: run rgb ourselves */
+    if (!blink->rgb && !lights_blink_offload(blink))
+        return 0;
+
+    ret = lights_scheduler_start(s);
+    if (ret)
+        return ret;
+    blink->repeat = pattern->repeat;
+    blink->phase = LIGHT_PHASE_RISE;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    blink->phase_end = now;
+    ts_add_ms(&blink->phase_end, pattern->rise_ms);
+    lights_blink_advance(blink, &now);
+    heap_push(s, blink);
+    *rearm = 1;
+
+    return 0;
+}
+
+static int lights_blink_set(struct light_blink *blink, unsigned char brightness,
+                            unsigned int color,
+                            const struct light_pattern_t *pattern)
+{
+    struct light_scheduler *s = &blink_scheduler;
+    int ret, rearm = 0;
+
+    if (pthread_mutex_lock(&s->lock)) {
+        LIGHTS_LOGE_RL("Error: <%s>: pthread_mutex_lock\n", __func__);
+        return -1;
+    }
+    ret = lights_blink_update(s, blink, brightness, color, pattern, &rearm);
+    if (rearm)
+        lights_scheduler_arm(s);
+    if (pthread_mutex_unlock(&s->lock)) {
+        LIGHTS_LOGE_RL("Error: <%s>: pthread_mutex_unlock\n", __func__);
+        return -1;
+    }
+
+    return ret;
+}
+
+static inline int __is_on(const struct light_state_t *state)
+{
+    return state->color & 0x00ffffff;
+}
+
+static inline unsigned char
+__rgb_to_brightness(const struct light_state_t *state)
+{
+    int color = state->color & 0x00ffffff;
+    unsigned char brightness = ((77 * ((color >> 16) & 0x00ff))
+                                + (150 * ((color >> 8) & 0x00ff))
+                                + (29 * (color & 0x00ff))) >> 8;
+    return brightness;
+}
+
+static unsigned char __on_off_brightness(const struct light_state_t *state)
+{
+    return __is_on(state) ? LIGHT_LED_FULL : LIGHT_LED_OFF;
+}
+
+/* level as routed to panel (0: primary) */
+static unsigned int lights_route_level(struct lights_ctx *ctx, int panel,
+                                       unsigned int level)
+{
+    if (ctx->route != LIGHT_ROUTE_SCALE)
+        return level;
+    return level * ctx->scale[panel] / 1000;
+}
+
+/*
+ * Fan a backlight level out to the extra panels. Each is queued on its
+ * own writer, so this never waits for a write.
+ */
+static void lights_panels_post(struct lights_ctx *ctx, unsigned int level,
+                               int duration_ms, int curve)
+{
+    struct light_panel *panel;
+    int i, intensity;
+
+    for (i = 0; i < ctx->nr_panels; i++) {
+        panel = &ctx->panels[i];
+        intensity = lights_curve_map(&panel->node.curve,
+                                     lights_route_level(ctx, i + 1, level),
+                                     panel->node.max_brightness);
+        lights_writer_post_ramp(&panel->writer, intensity, duration_ms, curve);
+    }
+}
+
+#ifdef LIGHT_BACKLIGHT_ALS
+static int lights_als_read(struct light_als *als, float *lux)
+{
+    char buf[32];
+    ssize_t len;
+
+    len = pread(als->fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0)
+        return len < 0 && errno ? -errno : -EIO;
+    buf[len] = '\0';
+    *lux = strtof(buf, NULL);
+    if (*lux < 0.0f)
+        *lux = 0.0f;
+
+    return 0;
+}
+
+static void lights_als_arm(struct light_als *als, int ms)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    if (timerfd_settime(als->timer.fd, 0, &its, NULL))
+        LIGHTS_LOGE_RL("Error: <%s>: timerfd_settime, errno = %d\n", __func__, errno);
+}
+
+/* log scale: each decade of lux is an equal step of perceived brightness */
+static unsigned int lights_als_level(float lux)
+{
+    float f = log10f(1.0f + lux) / log10f(1.0f + LIGHT_ALS_LUX_MAX);
+
+    if (f > 1.0f)
+        f = 1.0f;
+    return LIGHT_ALS_LEVEL_MIN + (LIGHT_LEVEL_MAX - LIGHT_ALS_LEVEL_MIN) * f;
+}
+
+static void lights_als_follow(struct light_als *als)
+{
+    struct light_node *node = &context->nodes[LIGHT_TYPE_BACKLIGHT];
+    struct light_writer *writer = lights_get_writer(context);
+    unsigned int level = lights_als_level(als->lux);
+    int intensity;
+
+    if (!writer)
+        return;
+    als->anchor = als->lux;
+    lights_panels_post(context, level, LIGHT_ALS_FADE_MS, LIGHT_CURVE_GAMMA);
+    intensity = lights_curve_map(&node->curve,
+                                 lights_route_level(context, 0, level),
+                                 node->max_brightness);
+    LIGHTS_LOGV("als: %.1f lux, intensity %d\n", als->lux, intensity);
+    lights_writer_post_ramp(writer, intensity, LIGHT_ALS_FADE_MS,
+                            LIGHT_CURVE_GAMMA);
+}
+
+static void lights_als_expire(struct lights_watch *watch)
+{
+    struct light_als *als = container_of(watch, struct light_als, timer);
+    uint64_t expirations;
+    float lux, tau, band;
+    long dt;
+    int poll_ms = LIGHT_ALS_POLL_SLOW_MS;
+
+    if (read(watch->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    pthread_mutex_lock(&als->lock);
+    if (!als->enabled)
+        goto out;
+    if (lights_als_read(als, &lux)) {
+        LIGHTS_LOGE_RL("als: read failed, errno = %d\n", errno);
+        goto arm;
+    }
+
+    if (als->anchor < 0) {
+        /* first sample after enabling: jump straight to it */
+        als->lux = lux;
+    } else {
+        dt = elapsed_ms(&als->sampled);
+        tau = lux > als->lux ? LIGHT_ALS_BRIGHTEN_TAU_MS
+                             : LIGHT_ALS_DARKEN_TAU_MS;
+        als->lux += (lux - als->lux) * (1.0f - expf(-dt / tau));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &als->sampled);
+
+    band = LIGHT_ALS_HYSTERESIS * (als->anchor > 1.0f ? als->anchor : 1.0f);
+    if (als->anchor < 0 || fabsf(als->lux - als->anchor) > band)
+        lights_als_follow(als);
+    if (fabsf(lux - als->lux) > band)
+        poll_ms = LIGHT_ALS_POLL_FAST_MS;
+
+arm:
+    lights_als_arm(als, poll_ms);
+out:
+    pthread_mutex_unlock(&als->lock);
+}
+
+/*
+ * Start (on) or stop following the sensor. Fails when there is no sensor
+ * to follow, in which case the caller sets the brightness it was given.
+ */
+static int lights_als_enable(struct light_als *als, int on)
+{
+    char path[PROPERTY_VALUE_MAX];
+    int ret = 0;
+
+    pthread_mutex_lock(&als->lock);
+    if (!on || als->enabled) {
+        if (!on && als->enabled) {
+            als->enabled = 0;
+            lights_als_arm(als, 0);
+        }
+        goto out;
+    }
+
+    if (als->fd < 0) {
+        property_get(LIGHT_PROP_ALS_PATH, path, LIGHT_ALS_PATH_DEFAULT);
+        als->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (als->fd < 0) {
+            ret = -errno;
+            LIGHTS_LOGE_RL("als: faild to open %s, errno = %d\n",
+                           path, errno);
+            goto out;
+        }
+        LIGHTS_LOGD("als: %s\n", path);
+    }
+    if (als->timer.fd < 0) {
+        ret = lights_loop_start(&event_loop);
+        if (ret)
+            goto out;
+        als->timer.fd = timerfd_create(CLOCK_MONOTONIC,
+                                       TFD_NONBLOCK | TFD_CLOEXEC);
+        if (als->timer.fd < 0) {
+            ret = -errno;
+            LIGHTS_LOGE("Error: <%s>: timerfd_create, errno = %d\n", __func__, errno);
+            goto out;
+        }
+        als->timer.handler = lights_als_expire;
+        ret = lights_loop_add(&event_loop, &als->timer);
+        if (ret) {
+            close(als->timer.fd);
+            als->timer.fd = -1;
+            goto out;
+        }
+    }
+
+    als->enabled = 1;
+    als->anchor = -1.0f;
+    lights_als_arm(als, 1);
+
+out:
+    pthread_mutex_unlock(&als->lock);
+    return ret;
+}
+#endif
+
+struct lights_batch;
+static const struct light_desc *lights_find_desc(const char *id);
+static int lights_led_apply(const struct light_desc *desc,
+                            const struct light_state_t *state,
+                            const struct light_pattern_t *pattern,
+                            struct lights_batch *batch);
+
+/*
+ * Switch the power state; back to ON, the lights that were deferred get
+ * their last state written, after the coalescing cache is dropped since
+ * the LED drivers may have reset behind our back during suspend.
+ */
+static void lights_power_set(struct lights_ctx *ctx, int state)
+{
+    struct light_deferred *deferred;
+    int i, was;
+
+    pthread_mutex_lock(&ctx->power_lock);
+    was = ctx->power_state;
+    ctx->power_state = state;
+    if (state == LIGHT_POWER_ON && was != LIGHT_POWER_ON) {
+        lights_invalidate(ctx);
+        for (i = 0; i < LIGHT_TYPE_MAX; i++) {
+            deferred = &ctx->deferred[i];
+            if (!deferred->desc)
+                continue;
+            lights_led_apply(deferred->desc, &deferred->state,
+                             deferred->patterned ? &deferred->pattern : NULL,
+                             NULL);
+            deferred->desc = NULL;
+        }
+    }
+    pthread_mutex_unlock(&ctx->power_lock);
+}
+
+static void lights_backlight_resume_check(int brightness)
+{
+    if (brightness == LIGHT_LED_OFF) {
+        /* an explicit suspend hint stays in force */
+        if (context->power_state == LIGHT_POWER_ON)
+            lights_power_set(context, LIGHT_POWER_DISPLAY_OFF);
+        return;
+    }
+
+    /*
+     * The panel coming back on usually means we are resuming, and the
+     * LED drivers may have reset their state behind our back: drop the
+     * coalescing cache so every light is rewritten on its next update.
+     */
+    if (context->power_state != LIGHT_POWER_ON)
+        lights_power_set(context, LIGHT_POWER_ON);
+    else if (context->nodes[LIGHT_TYPE_BACKLIGHT].last_intensity == 0)
+        lights_invalidate(context);
+}
+
+static int lights_backlight_apply(const struct light_desc *desc,
+                                  const struct light_state_t *state)
+{
+    int brightness = desc->to_brightness(state);
+
+    stats_inc(context->nodes[LIGHT_TYPE_BACKLIGHT].stats.calls);
+    lights_backlight_resume_check(brightness);
+
+#ifdef LIGHT_BACKLIGHT_ALS
+    /* while the panel is on, the HAL follows the ambient light itself */
+    if (state->brightnessMode == BRIGHTNESS_MODE_SENSOR
+        && brightness != LIGHT_LED_OFF
+        && !lights_als_enable(&backlight_als, 1))
+        return 0;
+    lights_als_enable(&backlight_als, 0);
+#endif
+
+    lights_panels_post(context, brightness_to_level(brightness), 0,
+                       LIGHT_CURVE_LINEAR);
+    if (context->route == LIGHT_ROUTE_SCALE)
+        brightness = brightness * context->scale[0] / 1000;
+
+    /* once the writer runs, order plain updates against its ramps */
+    if (context->backlight_writer)
+        return lights_writer_post(context->backlight_writer, brightness);
+    return write_brightness(&context->nodes[LIGHT_TYPE_BACKLIGHT], brightness);
+}
+
+static int
+set_light_backlight(struct light_device_t *dev,
+                    const struct light_state_t *state)
+{
+    return lights_backlight_apply(lights_device_desc(dev), state);
+}
+
+static int
+set_light_backlight_ramp(struct light_device_ext_t *dev,
+                         const struct light_state_t *state,
+                         int duration_ms, int curve)
+{
+    struct light_writer *writer;
+    int brightness = lights_device_desc(&dev->common)->to_brightness(state);
+    int intensity;
+
+    stats_inc(context->nodes[LIGHT_TYPE_BACKLIGHT].stats.calls);
+    if (duration_ms < 0 || curve < LIGHT_CURVE_LINEAR || curve > LIGHT_CURVE_CIE)
+        return -EINVAL;
+
+    writer = lights_get_writer(context);
+    if (!writer)
+        return -ENOMEM;
+
+#ifdef LIGHT_BACKLIGHT_ALS
+    lights_als_enable(&backlight_als, 0);
+#endif
+    lights_backlight_resume_check(brightness);
+    lights_panels_post(context, brightness_to_level(brightness), duration_ms,
+                       curve);
+    if (context->route == LIGHT_ROUTE_SCALE)
+        brightness = brightness * context->scale[0] / 1000;
+    intensity = context->nodes[LIGHT_TYPE_BACKLIGHT].intensity[brightness];
+
+    return lights_writer_post_ramp(writer, intensity, duration_ms, curve);
+}
+
+static int
+set_light_backlight_level(struct light_device_ext_t *dev, unsigned int level,
+                          int duration_ms, int curve)
+{
+    struct light_node *node = &context->nodes[LIGHT_TYPE_BACKLIGHT];
+    struct light_writer *writer;
+    int intensity;
+
+    stats_inc(node->stats.calls);
+    if (level > LIGHT_LEVEL_MAX || duration_ms < 0
+        || curve < LIGHT_CURVE_LINEAR || curve > LIGHT_CURVE_CIE)
+        return -EINVAL;
+
+#ifdef LIGHT_BACKLIGHT_ALS
+    lights_als_enable(&backlight_als, 0);
+#endif
+    lights_backlight_resume_check(level);
+    lights_panels_post(context, level, duration_ms, curve);
+    intensity = lights_curve_map(&node->curve,
+                                 lights_route_level(context, 0, level),
+                                 node->max_brightness);
+
+    /* a jump needs no thread unless one is already ordering our writes */
+    writer = context->backlight_writer;
+    if (!writer && !duration_ms)
+        return write_intensity(node, intensity);
+    if (!writer && !(writer = lights_get_writer(context)))
+        return -ENOMEM;
+
+    return lights_writer_post_ramp(writer, intensity, duration_ms, curve);
+}
+
+/*
+ * What a set_lights() batch owes the background threads once all of its
+ * lights are applied, so each is woken at most once.
+ */
+struct lights_batch {
+    int kick;		/* event loop: auto-off requests posted */
+    int rearm;		/* blink scheduler: heap changed */
+};
+
+/*
+ * Apply state to a light other than the backlight, running pattern
+ * instead of the flash state asks for if there is one. Within a batch
+ * (batch != NULL) the caller holds blink_scheduler.lock and settles the
+ * wake ups afterwards.
+ */
+static int lights_led_apply(const struct light_desc *desc,
+                            const struct light_state_t *state,
+                            const struct light_pattern_t *pattern,
+                            struct lights_batch *batch)
+{
+    struct light_info *info = context->infos[desc->type];
+    unsigned char brightness = desc->to_brightness(state);
+    unsigned int color = state->color & 0x00ffffff;
+    struct light_pattern_t flash;
+
+    if (info) {
+        /* the event loop owns lights with auto off */
+        if (lights_info_post(info, brightness) & LIGHT_REQ_PENDING)
+            return 0;	/* the loop is yet to take the last one: ours */
+        if (batch) {
+            batch->kick = 1;
+            return 0;
+        }
+        return lights_loop_kick(&event_loop);
+    }
+
+    if (desc->blink && !pattern)
+        pattern = lights_state_pattern(state, &flash);
+    if (desc->blink && batch)
+        return lights_blink_update(&blink_scheduler,
+                                   &context->blinks[desc->type], brightness,
+                                   color, pattern, &batch->rearm);
+    if (desc->blink)
+        return lights_blink_set(&context->blinks[desc->type], brightness,
+                                color, pattern);
+
+    return write_brightness(&context->nodes[desc->type], brightness);
+}
+
+static int lights_set_power_state(struct light_device_ext_t *dev, int state)
+{
+    if (state < LIGHT_POWER_ON || state > LIGHT_POWER_SUSPEND)
+        return -EINVAL;
+
+    lights_power_set(context, state);
+    return 0;
+}
+
+/*
+ * Every light but the backlight, with power_lock held: keep state (and
+ * pattern) for later if the display is off. Turning a light off is never
+ * held back, and a light with auto off still hands the value to the loop
+ * for its next wake event, only the write waits.
+ */
+static int lights_led_defer(const struct light_desc *desc,
+                            const struct light_state_t *state,
+                            const struct light_pattern_t *pattern)
+{
+    struct light_deferred *deferred = &context->deferred[desc->type];
+    struct light_info *info = context->infos[desc->type];
+    unsigned char brightness = desc->to_brightness(state);
+
+    if (context->power_state != LIGHT_POWER_ON
+        && !context->write_through[desc->type]
+        && brightness != LIGHT_LED_OFF) {
+        stats_inc(context->nodes[desc->type].stats.deferred);
+        if (info)
+            lights_info_stash(info, brightness);
+        deferred->desc = desc;
+        deferred->state = *state;
+        deferred->patterned = pattern != NULL;
+        if (pattern)
+            deferred->pattern = *pattern;
+        return 1;
+    }
+    deferred->desc = NULL;
+
+    return 0;
+}
+
+static int set_light_led(struct light_device_t *dev,
+                         const struct light_state_t *state)
+{
+    const struct light_desc *desc = lights_device_desc(dev);
+    int ret = 0;
+
+    stats_inc(context->nodes[desc->type].stats.calls);
+
+    /* held across the write so a resume flush can't overtake it */
+    pthread_mutex_lock(&context->power_lock);
+    if (!lights_led_defer(desc, state, NULL))
+        ret = lights_led_apply(desc, state, NULL, NULL);
+    pthread_mutex_unlock(&context->power_lock);
+
+    return ret;
+}
+
+static int lights_set_light_pattern(struct light_device_ext_t *dev,
+                                    const struct light_state_t *state,
+                                    const struct light_pattern_t *pattern)
+{
+    const struct light_desc *desc = lights_device_desc(&dev->common);
+    int ret = 0;
+
+    stats_inc(context->nodes[desc->type].stats.calls);
+    if (!pattern || pattern->rise_ms < 0 || pattern->on_ms < 0
+        || pattern->fall_ms < 0 || pattern->off_ms < 0 || pattern->repeat < 0
+        || !(pattern->rise_ms || pattern->on_ms || pattern->fall_ms
+             || pattern->off_ms))
+        return -EINVAL;
+
+    pthread_mutex_lock(&context->power_lock);
+    if (!lights_led_defer(desc, state, pattern))
+        ret = lights_led_apply(desc, state, pattern, NULL);
+    pthread_mutex_unlock(&context->power_lock);
+
+    return ret;
+}
+
+static int lights_desc_opened(const struct lights_ctx *ctx,
+                              const struct light_desc *desc)
+{
+    return ctx->nodes[desc->type].path
+           || (desc->rgb && ctx->rgb.present);
+}
+
+/*
+ * Every entry is checked before anything is written. The backlight goes
+ * first, since turning the panel on flushes deferred lights under
+ * power_lock; the rest are applied holding power_lock and the blink
+ * scheduler lock throughout, which is what any other set_light(), resume
+ * flush or blink step waits on, so none of them sees part of the batch.
+ * Auto-off lights are the exception: the loop owns their node and writes
+ * them once it is kicked, after the locks are dropped.
+ */
+static int lights_set_lights(struct light_device_ext_t *dev,
+                             const struct light_batch_entry_t *entries,
+                             int count)
+{
+    const struct light_desc *descs[LIGHT_BATCH_MAX];
+    struct lights_batch batch = {0, 0};
+    int i, err, ret = 0;
+
+    if (count < 0 || count > LIGHT_BATCH_MAX || (count && !entries))
+        return -EINVAL;
+    for (i = 0; i < count; i++) {
+        descs[i] = entries[i].id ? lights_find_desc(entries[i].id) : NULL;
+        if (!descs[i])
+            return -EINVAL;
+        if (!lights_desc_opened(context, descs[i]))
+            return -ENODEV;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (descs[i]->type != LIGHT_TYPE_BACKLIGHT)
+            continue;
+        err = lights_backlight_apply(descs[i], &entries[i].state);
+        if (err)
+            ret = err;
+    }
+
+    pthread_mutex_lock(&context->power_lock);
+    pthread_mutex_lock(&blink_scheduler.lock);
+    for (i = 0; i < count; i++) {
+        if (descs[i]->type == LIGHT_TYPE_BACKLIGHT)
+            continue;
+        stats_inc(context->nodes[descs[i]->type].stats.calls);
+        if (lights_led_defer(descs[i], &entries[i].state, NULL))
+            continue;
+        err = lights_led_apply(descs[i], &entries[i].state, NULL, &batch);
+        if (err)
+            ret = err;
+    }
+    if (batch.rearm)
+        lights_scheduler_arm(&blink_scheduler);
+    pthread_mutex_unlock(&blink_scheduler.lock);
+    if (batch.kick)
+        lights_loop_kick(&event_loop);
+    pthread_mutex_unlock(&context->power_lock);
+
+    return ret;
+}
+
+/* lights close method */
+static int close_lights_dev(struct light_device_t *dev)
+{
+    if (dev)
+        free(dev);
+
+    return 0;
+}
+
+static inline void lights_set_bit(unsigned int bit, unsigned long *map)
+{
+	map[bit / LIGHT_BITS_PER_LONG] |= 1UL << (bit % LIGHT_BITS_PER_LONG);
+}
+
+static inline int lights_test_bit(unsigned int bit, const unsigned long *map)
+{
+	return (map[bit / LIGHT_BITS_PER_LONG] >> (bit % LIGHT_BITS_PER_LONG)) & 1;
+}
+
+static void lights_wake_build_keys(struct light_wake_event *wake)
+{
+	int j;
+
+	memset(wake->keys, 0, sizeof(wake->keys));
+	for (j = 0; j < WAKE_KEY_MAX && wake->key[j] != -1; j ++) {
+		if (wake->key[j] == KEY_ANY) {
+			memset(wake->keys, 0xff, sizeof(wake->keys));
+			break;
+		}
+		if (wake->key[j] >= 0 && wake->key[j] < KEY_CNT)
+			lights_set_bit(wake->key[j], wake->keys);
+	}
+
+	memset(wake->needs, 0, sizeof(wake->needs));
+	wake->nr_needs = 0;
+	for (j = 0; j < WAKE_KEY_MAX && wake->need[j] > 0; j ++) {
+		if (wake->need[j] < KEY_CNT) {
+			lights_set_bit(wake->need[j], wake->needs);
+			wake->nr_needs++;
+		}
+	}
+}
+
+/*
+ * Have the kernel drop every event but the wake ones: it then also skips
+ * the SYN_REPORTs of emptied packets, so the loop is only woken for wake
+ * keys. Without EVIOCSMASK the filtering stays in lights_is_wake_event().
+ */
+static void lights_wake_set_mask(struct light_wake_event *wake, int fd)
+{
+	unsigned long types[LIGHT_BITS_TO_LONGS(EV_CNT)];
+	struct input_mask mask;
+
+	memset(types, 0, sizeof(types));
+	lights_set_bit(wake->type, types);
+	mask.type = 0;		/* the event type mask */
+	mask.codes_size = sizeof(types);	/* bytes */
+	mask.codes_ptr = (uintptr_t)types;
+	if (ioctl(fd, EVIOCSMASK, &mask)) {
+		LIGHTS_LOGD("<%s>: no EVIOCSMASK, errno = %d\n",
+			    wake->info->name, errno);
+		return;
+	}
+
+	if (wake->type == EV_KEY) {
+		mask.type = EV_KEY;
+		mask.codes_size = sizeof(wake->keys);
+		mask.codes_ptr = (uintptr_t)wake->keys;
+		if (ioctl(fd, EVIOCSMASK, &mask))
+			LIGHTS_LOGD("<%s>: no EV_KEY mask, errno = %d\n",
+				    wake->info->name, errno);
+	}
+}
+
+/* does this input event ask for the light to be woken up? */
+static int lights_is_wake_event(const struct light_wake_event *wake,
+                                const struct input_event *event)
+{
+	if (event->type != wake->type)
+		return 0;
+	if (event->type == EV_ABS)
+		return 1;
+	if (event->type != EV_KEY || event->code >= KEY_CNT)
+		return 0;
+
+	return lights_test_bit(event->code, wake->keys);
+}
+
+static int lights_input_num(const char *name)
+{
+	char *end;
+	long num;
+
+	if (strncmp(name, "event", 5))
+		return -1;
+	num = strtol(name + 5, &end, 10);
+	if (end == name + 5 || *end || num < 0 || num > INT_MAX)
+		return -1;
+
+	return num;
+}
+
+/* caps of the device open on fd, NULL if it is no input device */
+static const struct light_input_caps *lights_input_caps(int fd)
+{
+	struct light_hotplug *hp = &input_hotplug;
+	struct light_input_caps *caps;
+	struct input_id id;
+	char name[LIGHT_INPUT_NAME_MAX];
+	int i;
+
+	memset(name, 0, sizeof(name));
+	if (ioctl(fd, EVIOCGID, &id)
+	    || ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name) < 0)
+		return NULL;
+
+	for (i = 0; i < LIGHT_CAPS_CACHE; i++) {
+		caps = &hp->cache[i];
+		if (caps->valid && !memcmp(&caps->id, &id, sizeof(id))
+		    && !strcmp(caps->name, name))
+			return caps;
+	}
+
+	caps = &hp->cache[hp->next];
+	hp->next = (hp->next + 1) % LIGHT_CAPS_CACHE;
+	memset(caps, 0, sizeof(*caps));
+	if (ioctl(fd, EVIOCGBIT(0, sizeof(caps->types)), caps->types) < 0
+	    || ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(caps->keys)), caps->keys) < 0)
+		return NULL;
+	caps->id = id;
+	memcpy(caps->name, name, sizeof(name));
+	caps->valid = 1;
+
+	return caps;
+}
+
+static int lights_wake_match(const struct light_wake_event *wake,
+			     const struct light_input_caps *caps,
+			     const char *path)
+{
+	unsigned int i;
+
+	if (wake->name[0]) {
+		if (strcmp(wake->name, caps->name))
+			return 0;
+	} else if (wake->nr_needs) {
+		for (i = 0; i < LIGHT_BITS_TO_LONGS(KEY_CNT); i++) {
+			if ((wake->needs[i] & caps->keys[i]) != wake->needs[i])
+				return 0;
+		}
+	} else if (!wake->file || strcmp(wake->file, path)) {
+		return 0;
+	}
+	if (!lights_test_bit(wake->type, caps->types))
+		return 0;
+	if (wake->type != EV_KEY)
+		return 1;
+	for (i = 0; i < LIGHT_BITS_TO_LONGS(KEY_CNT); i++) {
+		if (wake->keys[i] & caps->keys[i])
+			return 1;
+	}
+
+	return 0;
+}
+
+static void lights_info_wake(struct lights_watch *watch);
+
+/* hands fd over to a free slot of wake; called with input_hotplug.lock */
+static int lights_wake_attach(struct light_wake_event *wake, int fd, int num)
+{
+	struct light_wake_dev *dev, **devs;
+	int i;
+
+	for (i = 0; i < wake->nr_devs; i++) {
+		if (wake->devs[i]->watch.fd < 0)
+			break;
+	}
+	if (i == wake->nr_devs) {
+		devs = realloc(wake->devs, (i + 1) * sizeof(*devs));
+		if (devs) {
+			wake->devs = devs;
+			devs[i] = calloc(1, sizeof(*devs[i]));
+		}
+		if (!devs || !devs[i]) {
+			LIGHTS_LOGE("<%s>: no memory for event%d\n",
+				    wake->info->name, num);
+			return -ENOMEM;
+		}
+		devs[i]->watch.fd = -1;
+		wake->nr_devs++;
+	}
+	dev = wake->devs[i];
+
+	dev->wake = wake;
+	dev->num = num;
+	dev->watch.handler = lights_info_wake;
+	dev->watch.fd = fd;
+	lights_wake_set_mask(wake, fd);
+	if (lights_loop_add(&event_loop, &dev->watch)) {
+		dev->watch.fd = -1;
+		return -EAGAIN;
+	}
+	LIGHTS_LOGD("<%s>: event%d attached\n", wake->info->name, num);
 
-	/*set brightness to default*/
-	write_brightness(info->fd, info->brightness);
-	info->brightness_status = info->brightness;
-	if (info->brightness != LIGHT_LED_OFF)
-		info->need_auto_off = 1;
-	pthread_create(&tid, NULL, lights_events_thread, info);
+	return 0;
+}
 
-	for (;;) {
-		/* wait for update request */
-		if (!pthread_mutex_lock(&info->lock)) {
-			if (info->need_update) {
-				LOGE("<%s>: update to %d\n", info->name, info->brightness);
-				info->need_update = 0;
-				if (info->brightness_status != info->brightness) {
-					info->brightness_status = info->brightness;
-					write_brightness(info->fd, info->brightness);
-				}
-			} else {
-				LOGE("<%s>: auto off\n", info->name);
-				if (info->brightness_status != LIGHT_LED_OFF) {
-					info->brightness_status = LIGHT_LED_OFF;
-					write_brightness(info->fd, LIGHT_LED_OFF);
-				}
-			}
-			if (info->brightness_status == LIGHT_LED_OFF) {
-				LOGE("<%s>: wait update\n", info->name);
-				if (pthread_cond_wait(&info->cond, &info->lock))
-					LOGE("Error: <%s>: pthread_cond_wait\n", __func__);
-			} else {
-				LOGE("<%s>: wait auto off\n", info->name);
-				clock_gettime(CLOCK_REALTIME, &ts);
-				ts.tv_sec += info->auto_off_time;
-				if (pthread_cond_timedwait(&info->cond, &info->lock, &ts))
-					LOGE("Error: <%s>: pthread_cond_timedwait\n", __func__);
+/* called with input_hotplug.lock */
+static void lights_wake_detach(struct light_wake_dev *dev)
+{
+	LIGHTS_LOGD("<%s>: event%d detached\n", dev->wake->info->name, dev->num);
+	epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_DEL, dev->watch.fd, NULL);
+	close(dev->watch.fd);
+	dev->watch.fd = -1;
+}
+
+/* is event<num> (num < 0: any device) attached? called with input_hotplug.lock */
+static int lights_wake_attached(const struct light_wake_event *wake, int num)
+{
+	int i;
+
+	for (i = 0; i < wake->nr_devs; i++) {
+		if (wake->devs[i]->watch.fd >= 0
+		    && (num < 0 || wake->devs[i]->num == num))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* LIGHT_INPUT_DIR/eventN appeared (or became readable) */
+static void lights_hotplug_add(int num)
+{
+	const struct light_input_caps *caps;
+	struct light_wake_event *wake;
+	struct light_info *info;
+	char path[PATH_MAX];
+	int i, j, fd, used;
+
+	snprintf(path, sizeof(path), LIGHT_INPUT_DIR "/event%d", num);
+	fd = open(path, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+	if (fd < 0)
+		return;		/* retried on IN_ATTRIB once ueventd chmods it */
+
+	pthread_mutex_lock(&input_hotplug.lock);
+	caps = lights_input_caps(fd);
+	for (i = 0; caps && i < event_loop.nr_infos; i++) {
+		info = event_loop.infos[i];
+		for (j = 0; j < info->nr_events; j++) {
+			wake = &info->events[j];
+			if (lights_wake_attached(wake, num)
+			    || !lights_wake_match(wake, caps, path))
+				continue;
+			/* every wake event gets a fd of its own for its mask */
+			used = fd >= 0 ? fd : open(path, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+			if (used >= 0 && lights_wake_attach(wake, used, num))
+				close(used);
+			fd = -1;
+		}
+	}
+	pthread_mutex_unlock(&input_hotplug.lock);
+
+	if (fd >= 0)
+		close(fd);
+}
+
+static void lights_hotplug_remove(int num)
+{
+	struct light_wake_dev *dev;
+	struct light_info *info;
+	int i, j, k;
+
+	pthread_mutex_lock(&input_hotplug.lock);
+	for (i = 0; i < event_loop.nr_infos; i++) {
+		info = event_loop.infos[i];
+		for (j = 0; j < info->nr_events; j++) {
+			for (k = 0; k < info->events[j].nr_devs; k++) {
+				dev = info->events[j].devs[k];
+				if (dev->watch.fd >= 0 && dev->num == num)
+					lights_wake_detach(dev);
 			}
-			if (pthread_mutex_unlock(&info->lock)) {
-				LOGE("Error: <%s>: pthread_mutex_unlock\n", __func__);
-				return NULL;
+		}
+	}
+	pthread_mutex_unlock(&input_hotplug.lock);
+}
+
+static void lights_hotplug_event(struct lights_watch *watch)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t len;
+	char *p;
+	int num;
+
+	while ((len = read(watch->fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len;
+		     p += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *)p;
+			num = event->len ? lights_input_num(event->name) : -1;
+			if (num < 0)
+				continue;
+			if (event->mask & IN_DELETE)
+				lights_hotplug_remove(num);
+			else
+				lights_hotplug_add(num);
+		}
+	}
+}
+
+static void lights_hotplug_scan(void)
+{
+	struct dirent *entry;
+	DIR *d;
+	int num;
+
+	d = opendir(LIGHT_INPUT_DIR);
+	if (!d)
+		return;
+	while ((entry = readdir(d))) {
+		num = lights_input_num(entry->d_name);
+		if (num >= 0)
+			lights_hotplug_add(num);
+	}
+	closedir(d);
+}
+
+/* watch LIGHT_INPUT_DIR, then pick up what is already there */
+static void lights_hotplug_start(void)
+{
+	struct light_hotplug *hp = &input_hotplug;
+
+	pthread_mutex_lock(&hp->lock);
+	if (hp->watch.fd < 0) {
+		hp->watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (hp->watch.fd >= 0
+		    && inotify_add_watch(hp->watch.fd, LIGHT_INPUT_DIR,
+					 IN_CREATE | IN_ATTRIB | IN_DELETE) < 0) {
+			close(hp->watch.fd);
+			hp->watch.fd = -1;
+		}
+		hp->watch.handler = lights_hotplug_event;
+		if (hp->watch.fd < 0 || lights_loop_add(&event_loop, &hp->watch))
+			LIGHTS_LOGE("Error: <%s>: no input hotplug, errno = %d\n",
+				    __func__, errno);
+	}
+	pthread_mutex_unlock(&hp->lock);
+
+	lights_hotplug_scan();
+}
+
+/* drain everything queued on the device, WAKE_READ_BATCH events per read */
+static int lights_read_wake_events(struct light_info *info,
+                                   struct light_wake_dev *dev)
+{
+	struct light_wake_event *wake = dev->wake;
+	struct input_event events[WAKE_READ_BATCH];
+	int need_wake = 0;
+	ssize_t ret;
+	int i, n;
+
+	for (;;) {
+		ret = read(dev->watch.fd, events, sizeof(events));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		/*
+		 * EOF: the writer of a FIFO or other plain file went away.
+		 * ENODEV: unplugged; inotify may not have told us yet.
+		 * EPOLLHUP/EPOLLERR with nothing left to read: hung up some
+		 * other way. The fd would stay ready forever, so let it go;
+		 * that frees its slot for the next device.
+		 */
+		if (ret == 0 || (ret < 0 && (errno == ENODEV
+		    || (dev->watch.events & (EPOLLHUP | EPOLLERR))))) {
+			pthread_mutex_lock(&input_hotplug.lock);
+			lights_wake_detach(dev);
+			pthread_mutex_unlock(&input_hotplug.lock);
+			break;
+		}
+		if (ret < 0) {
+			if (errno != EAGAIN)
+				LIGHTS_LOGE_RL("<%s>: read event%d failed, errno = %d\n",
+				     info->name, dev->num, errno);
+			break;
+		}
+		n = ret / sizeof(events[0]);
+		for (i = 0; i < n && !need_wake; i ++) {
+			if (lights_is_wake_event(wake, &events[i])) {
+				LIGHTS_LOGV("<%s>: EV_KEY wake up\n", info->name);
+				need_wake = 1;
 			}
-		} else {
-			LOGE("Error: <%s>: pthread_mutex_lock\n", __func__);
-			return NULL;
 		}
+		if (n < WAKE_READ_BATCH)
+			break;
 	}
 
-	return NULL;
+	return need_wake;
 }
 
-static void lights_init_info(struct light_info *info, int fd)
+/*
+ * Auto-off deadlines count suspended time so lights lit when the device
+ * went to sleep go off on resume; kernels before 3.11 lack timerfd
+ * CLOCK_BOOTTIME and get CLOCK_MONOTONIC. Neither jumps with wall time.
+ */
+static int lights_auto_off_timer(void)
 {
-    int i;
-    pthread_t tid;
+	int fd;
+
+	fd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (fd < 0 && errno == EINVAL)
+		fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+
+	return fd;
+}
+
+/* relative to now; 0 disarms */
+static void lights_info_arm(struct light_info *info, int ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	if (timerfd_settime(info->timer.fd, 0, &its, NULL))
+		LIGHTS_LOGE_RL("Error: <%s>: timerfd_settime, errno = %d\n", __func__, errno);
+}
 
-    if ((info == NULL) || (fd < 0))
-	    return;
-    info->fd = fd;
-    for (i = 0; i < WAKE_EVENT_MAX && info->events[i].file; i++) {
-	    info->events[i].fd = open(info->events[i].file, O_RDONLY|O_NONBLOCK);
-	    if (info->events[i].fd < 0) {
-		    LOGE("<%s>: open %s failed\n", info->name, info->events[i].file);
-	    } else {
-		    LOGD("<%s>: open %s success\n", info->name, info->events[i].file);
-	    }
-    }
-    if (pthread_mutex_init(&info->lock, NULL))
-	    return;
-    if (pthread_cond_init(&info->cond, NULL))
-	    return;
-    info->brightness = LIGHT_LED_OFF;
-    pthread_create(&tid, NULL, lights_update_thread, info);
-}
-
-static int lights_open_node(struct lights_ctx *ctx, struct light_device_t *dev,
-                            const char *id)
-{
-    struct light_info *info = NULL;
-    int *pfd;
-    char *path;
-    int (*set_light)(struct light_device_t* dev,
-                     struct light_state_t const* state);
-
-    if (!strcmp(LIGHT_ID_BACKLIGHT, id)) {
-        path = LIGHT_ID_BACKLIGHT_PATH;
-        pfd = &ctx->fds.backlight;
-        set_light = set_light_backlight;
-    }
-    else if (!strcmp(LIGHT_ID_KEYBOARD, id)) {
-        path = LIGHT_ID_KEYBOARD_PATH;
-        pfd = &ctx->fds.keyboard;
-        set_light = set_light_keyboard;
-    }
-    else if (!strcmp(LIGHT_ID_BUTTONS, id)) {
-        path = LIGHT_ID_BUTTONS_PATH;
-        pfd = &ctx->fds.buttons;
-        set_light = set_light_buttons;
+/*
+ * Hand brightness (or, if negative, just a wake up) to the loop. Returns
+ * the previous request word.
+ */
+static unsigned int lights_info_post(struct light_info *info, int brightness)
+{
+	unsigned int old, new;
+
+	do {
+		old = info->request;
+		new = old | LIGHT_REQ_PENDING;
+		if (brightness >= 0)
+			new = ((new & ~LIGHT_REQ_BRIGHTNESS)
+			       + (1u << LIGHT_REQ_GEN_SHIFT)) | brightness;
+	} while (!__sync_bool_compare_and_swap(&info->request, old, new));
+
+	return old;
+}
+
+/*
+ * Record brightness as the one to light up with without asking the loop
+ * to write it now: the next wake event (or post) picks it up.
+ */
+static void lights_info_stash(struct light_info *info, int brightness)
+{
+	unsigned int old, new;
+
+	do {
+		old = info->request;
+		new = ((old & ~LIGHT_REQ_BRIGHTNESS)
+		       + (1u << LIGHT_REQ_GEN_SHIFT)) | brightness;
+	} while (!__sync_bool_compare_and_swap(&info->request, old, new));
+}
+
+/* apply a pending request, then (re)start the auto-off countdown */
+static void lights_info_update(struct light_info *info)
+{
+	unsigned int request, generation;
+	int brightness;
+
+	do {
+		request = info->request;
+		if (!(request & LIGHT_REQ_PENDING))
+			return;
+	} while (!__sync_bool_compare_and_swap(&info->request, request,
+					       request & ~LIGHT_REQ_PENDING));
+
+	brightness = request & LIGHT_REQ_BRIGHTNESS;
+	generation = request >> LIGHT_REQ_GEN_SHIFT;
+	LIGHTS_LOGV("<%s>: update to %d (%u requests)\n", info->name,
+		    brightness, generation - info->generation);
+	info->generation = generation;
+
+	if (info->brightness_status != brightness) {
+		info->brightness_status = brightness;
+		write_brightness(info->node, brightness);
+	}
+	if (info->brightness_status == LIGHT_LED_OFF) {
+		LIGHTS_LOGV("<%s>: wait update\n", info->name);
+		lights_info_arm(info, 0);
+	} else {
+		LIGHTS_LOGV("<%s>: wait auto off\n", info->name);
+		lights_info_arm(info, info->auto_off_ms);
+	}
+}
+
+static void lights_info_auto_off(struct lights_watch *watch)
+{
+	struct light_info *info = container_of(watch, struct light_info, timer);
+	uint64_t expirations;
+
+	/* EAGAIN: re-armed by a wake event since it fired */
+	if (read(watch->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	LIGHTS_LOGV("<%s>: auto off\n", info->name);
+	if (info->brightness_status != LIGHT_LED_OFF) {
+		stats_inc(info->node->stats.auto_off);
+		info->brightness_status = LIGHT_LED_OFF;
+		write_brightness(info->node, LIGHT_LED_OFF);
+	}
+}
+
+static void lights_info_wake(struct lights_watch *watch)
+{
+	struct light_wake_dev *dev =
+		container_of(watch, struct light_wake_dev, watch);
+	struct light_info *info = dev->wake->info;
+
+	/* detached earlier in the same epoll batch */
+	if (watch->fd < 0)
+		return;
+	if (!lights_read_wake_events(info, dev))
+		return;
+	stats_inc(info->node->stats.wakes);
+
+	lights_info_post(info, -1);
+	lights_info_update(info);
+}
+
+/*
+ * Learn the name of the configured node, to follow it around. Returns 1
+ * when it did; a node that is no evdev device is attached as it is.
+ */
+static int lights_wake_learn(struct light_wake_event *wake)
+{
+    struct light_info *info = wake->info;
+    char name[LIGHT_INPUT_NAME_MAX];
+    int fd;
+
+    fd = open(wake->file, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+    if (fd < 0) {
+	    LIGHTS_LOGE("<%s>: open %s failed\n", info->name, wake->file);
+	    return 0;
+    }
+    memset(name, 0, sizeof(name));
+    if (ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name) >= 0) {
+	    LIGHTS_LOGD("<%s>: %s is \"%s\"\n", info->name, wake->file, name);
+	    close(fd);
+	    /* hotplug may be matching against it already */
+	    pthread_mutex_lock(&input_hotplug.lock);
+	    memcpy(wake->name, name, sizeof(name));
+	    pthread_mutex_unlock(&input_hotplug.lock);
+	    return 1;
+    }
+    /* not an evdev node we could follow: read it as it is */
+    pthread_mutex_lock(&input_hotplug.lock);
+    if (lights_wake_attach(wake, fd, -1))
+	    close(fd);
+    pthread_mutex_unlock(&input_hotplug.lock);
+
+    return 0;
+}
+
+static int lights_init_info(struct light_info *info, struct light_node *node)
+{
+    struct light_wake_event *wake;
+    int i, ret, learnt = 0;
+
+    if ((info == NULL) || (node->fd < 0))
+	    return -EINVAL;
+    info->node = node;
+    if (lights_loop_start(&event_loop))
+	    return -EAGAIN;
+
+    info->timer.fd = lights_auto_off_timer();
+    if (info->timer.fd < 0) {
+	    LIGHTS_LOGE("<%s>: timerfd_create failed, errno = %d\n", info->name, errno);
+	    return -errno;
+    }
+    info->timer.handler = lights_info_auto_off;
+    if (lights_loop_add(&event_loop, &info->timer)) {
+	    close(info->timer.fd);
+	    info->timer.fd = -1;
+	    return -EAGAIN;
+    }
+
+    for (i = 0; i < info->nr_events; i++) {
+	    wake = &info->events[i];
+	    wake->info = info;
+	    lights_wake_build_keys(wake);
+	    if (wake->file && !wake->name[0] && !wake->nr_needs)
+		    lights_wake_learn(wake);
+    }
+
+    /*set brightness to default*/
+    info->brightness_status = -1;
+    info->request = LIGHT_LED_OFF | LIGHT_REQ_PENDING;
+    ret = lights_loop_register(&event_loop, info);
+    if (ret)
+	    return ret;
+    lights_hotplug_start();
+
+    /* nothing has the keys needed: fall back to the configured node */
+    for (i = 0; i < info->nr_events; i++) {
+	    wake = &info->events[i];
+	    if (!wake->file || wake->name[0] || !wake->nr_needs)
+		    continue;
+	    pthread_mutex_lock(&input_hotplug.lock);
+	    ret = lights_wake_attached(wake, -1);
+	    pthread_mutex_unlock(&input_hotplug.lock);
+	    if (ret)
+		    continue;
+	    LIGHTS_LOGW("<%s>: no device has the keys needed, trying %s\n",
+			info->name, wake->file);
+	    learnt |= lights_wake_learn(wake);
+    }
+    if (learnt)
+	    lights_hotplug_scan();
+
+    return 0;
+}
+
+static const char *const keyboard_names[] = {
+    "keyboard-backlight", "kbd_backlight", "keyboard", NULL,
+};
+static const char *const buttons_names[] = {
+    "intel_keypad_led", "button-backlight", "keypad", "button", NULL,
+};
+static const char *const battery_names[] = {
+    "battery-backlight", "battery", "charging", NULL,
+};
+static const char *const notifications_names[] = {
+    "notifications-backlight", "notification", NULL,
+};
+static const char *const attention_names[] = {
+    "attention-backlight", "attention", NULL,
+};
+
+static const struct light_desc light_descs[] = {
+    {
+        .id = LIGHT_ID_BACKLIGHT,
+        .type = LIGHT_TYPE_BACKLIGHT,
+        .class_name = "backlight",
+        .legacy_dir = LIGHT_ID_BACKLIGHT_DIR,
+        .to_brightness = __rgb_to_brightness,
+        .set_light = set_light_backlight,
+        .set_light_ramp = set_light_backlight_ramp,
+        .set_light_level = set_light_backlight_level,
+        .coalesce = 1,
+    },
+    {
+        .id = LIGHT_ID_KEYBOARD,
+        .type = LIGHT_TYPE_KEYBOARD,
+        .class_name = "leds",
+        .names = keyboard_names,
+        .legacy_dir = LIGHT_ID_KEYBOARD_DIR,
+        .to_brightness = __on_off_brightness,
+        .set_light = set_light_led,
+        .coalesce = 1,
+    },
+    {
+        .id = LIGHT_ID_BUTTONS,
+        .type = LIGHT_TYPE_BUTTONS,
+        .class_name = "leds",
+        .names = buttons_names,
+        .legacy_dir = LIGHT_ID_BUTTONS_DIR,
+        .to_brightness = __on_off_brightness,
+        .set_light = set_light_led,
+        .coalesce = 1,
 #ifdef LIGHT_BUTTONS_AUTO_POWEROFF
-	info = ctx->button_info = &button_light_info;
+        .auto_off = &button_light_info,
 #endif
+    },
+    {
+        .id = LIGHT_ID_BATTERY,
+        .type = LIGHT_TYPE_BATTERY,
+        .class_name = "leds",
+        .names = battery_names,
+        .legacy_dir = LIGHT_ID_BATTERY_DIR,
+        .to_brightness = __on_off_brightness,
+        .set_light = set_light_led,
+        .coalesce = 1,
+    },
+    {
+        .id = LIGHT_ID_NOTIFICATIONS,
+        .type = LIGHT_TYPE_NOTIFICATIONS,
+        .class_name = "leds",
+        .names = notifications_names,
+        .legacy_dir = LIGHT_ID_NOTIFICATIONS_DIR,
+        .to_brightness = __on_off_brightness,
+        .set_light = set_light_led,
+        .coalesce = 1,
+        .blink = 1,
+        .rgb = 1,
+    },
+    {
+        .id = LIGHT_ID_ATTENTION,
+        .type = LIGHT_TYPE_ATTENTION,
+        .class_name = "leds",
+        .names = attention_names,
+        .legacy_dir = LIGHT_ID_ATTENTION_DIR,
+        .to_brightness = __on_off_brightness,
+        .set_light = set_light_led,
+        .coalesce = 1,
+        .blink = 1,
+    },
+};
+
+#define LIGHT_DESC_COUNT    (sizeof(light_descs) / sizeof(light_descs[0]))
+/* open addressed, power of two and at least twice LIGHT_DESC_COUNT */
+#define LIGHT_DESC_HASH     16
+
+static const struct light_desc *light_desc_hash[LIGHT_DESC_HASH];
+static pthread_once_t light_desc_once = PTHREAD_ONCE_INIT;
+
+static unsigned int lights_hash_id(const char *id)
+{
+    unsigned int hash = 5381;
+
+    while (*id)
+        hash = hash * 33 + (unsigned char)*id++;
+
+    return hash & (LIGHT_DESC_HASH - 1);
+}
+
+static void lights_build_desc_hash(void)
+{
+    unsigned int i, slot;
+
+    for (i = 0; i < LIGHT_DESC_COUNT; i++) {
+        slot = lights_hash_id(light_descs[i].id);
+        while (light_desc_hash[slot])
+            slot = (slot + 1) & (LIGHT_DESC_HASH - 1);
+        light_desc_hash[slot] = &light_descs[i];
+    }
+}
+
+static const struct light_desc *lights_find_desc(const char *id)
+{
+    const struct light_desc *desc;
+    unsigned int slot;
+
+    pthread_once(&light_desc_once, lights_build_desc_hash);
+
+    for (slot = lights_hash_id(id); (desc = light_desc_hash[slot]);
+         slot = (slot + 1) & (LIGHT_DESC_HASH - 1)) {
+        if (!strcmp(desc->id, id))
+            return desc;
+    }
+
+    return NULL;
+}
+
+static int dump_printf(int fd, const char *fmt, ...)
+{
+    char buff[256];
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(buff, sizeof(buff), fmt, args);
+    va_end(args);
+    if (len < 0)
+        return len;
+    if (len >= (int)sizeof(buff))
+        len = sizeof(buff) - 1;
+
+    return write(fd, buff, len) < 0 ? -errno : 0;
+}
+
+/*
+ * Render every opened light's counters as text. Counters are read while
+ * the HAL keeps running, so a dump is a consistent-enough snapshot, not
+ * an atomic one.
+ */
+static void lights_dump_node(int fd, const char *id,
+                             const struct light_node *node)
+{
+    const struct light_stats *st = &node->stats;
+    unsigned int j;
+
+    /* a light split into RGB channels has no node of its own */
+    dump_printf(fd, "%s: %s fd=%d max=%d last=%d\n", id,
+                node->path ? node->path : "rgb", node->fd,
+                node->max_brightness, node->last_intensity);
+    dump_printf(fd, "  calls=%lu writes=%lu coalesced=%lu syscalls=%lu"
+                " auto_off=%lu wakes=%lu deferred=%lu\n", st->calls,
+                st->writes, st->coalesced, node->syscalls, st->auto_off,
+                st->wakes, st->deferred);
+    for (j = 0; j < LIGHT_STATS_ERRNO_MAX; j++) {
+        if (st->errors[j])
+            dump_printf(fd, "  errno %u: %lu\n", j, st->errors[j]);
     }
-    else if (!strcmp(LIGHT_ID_BATTERY, id)) {
-        path = LIGHT_ID_BATTERY_PATH;
-        pfd = &ctx->fds.battery;
-        set_light = set_light_battery;
+    dump_printf(fd, "  write latency:");
+    for (j = 0; j < LIGHT_STATS_BUCKETS; j++) {
+        if (st->latency[j])
+            dump_printf(fd, " <%luus:%lu", 1UL << j, st->latency[j]);
     }
-    else if (!strcmp(LIGHT_ID_NOTIFICATIONS, id)) {
-        path = LIGHT_ID_NOTIFICATIONS_PATH;
-        pfd = &ctx->fds.notifications;
-        set_light = set_light_notifications;
+    dump_printf(fd, "\n");
+}
+
+static int lights_dump(struct lights_ctx *ctx, int fd)
+{
+    unsigned int i;
+
+    for (i = 0; i < LIGHT_DESC_COUNT; i++) {
+        if (lights_desc_opened(ctx, &light_descs[i]))
+            lights_dump_node(fd, light_descs[i].id,
+                             &ctx->nodes[light_descs[i].type]);
     }
-    else if (!strcmp(LIGHT_ID_ATTENTION, id)) {
-        path = LIGHT_ID_ATTENTION_PATH;
-        pfd = &ctx->fds.attention;
-        set_light = set_light_attention;
+    for (i = 0; i < LIGHT_CHANNEL_MAX; i++) {
+        if (ctx->rgb.channels[i].path)
+            lights_dump_node(fd, ctx->rgb.channels[i].id, &ctx->rgb.channels[i]);
     }
-    else
-        return -EINVAL;
+    for (i = 0; i < (unsigned int)ctx->nr_panels; i++)
+        lights_dump_node(fd, ctx->panels[i].id, &ctx->panels[i].node);
+
+    return 0;
+}
+
+static int lights_dump_dev(struct light_device_ext_t *dev, int fd)
+{
+    return lights_dump(context, fd);
+}
+
+/* snprintf() into a path buffer, failing rather than truncating */
+static int lights_path(char *buf, size_t size, const char *fmt, ...)
+        __attribute__((format(printf, 3, 4)));
 
-    *pfd = open(path, O_RDWR);
-    if (*pfd < 0) {
-        LOGE("faild to open %s, ret = %d\n", path, errno);
+static int lights_path(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+    if (len < 0 || (size_t)len >= size) {
+        buf[0] = '\0';
+        return -ENAMETOOLONG;
+    }
+
+    return 0;
+}
+
+static int read_attr_str(const char *dir, const char *attr, char *buf,
+                         size_t size)
+{
+    char path[PATH_MAX];
+    int fd, ret;
+
+    if (lights_path(path, sizeof(path), "%s/%s", dir, attr))
+        return -ENAMETOOLONG;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
         return -errno;
+    ret = read(fd, buf, size - 1);
+    ret = ret < 0 ? -errno : ret;
+    close(fd);
+    if (ret < 0)
+        return ret;
+
+    while (ret > 0 && (buf[ret - 1] == '\n' || buf[ret - 1] == ' '))
+        ret--;
+    buf[ret] = '\0';
+
+    return ret;
+}
+
+/*
+ * How well the class device dir/name fits desc, 0 if not at all. The
+ * backlight prefers firmware (ACPI) interfaces over platform drivers over
+ * raw PWM registers, the way the kernel documents the "type" attribute;
+ * LEDs are ranked by which of the descriptor's names they match, exact
+ * matches above substrings.
+ */
+static int lights_rank(const struct light_desc *desc, const char *dir,
+                       const char *name)
+{
+    char type[16];
+    int i, count;
+
+    if (!desc->names) {
+        if (read_attr_str(dir, "type", type, sizeof(type)) < 0)
+            type[0] = '\0';
+        if (!strcmp(type, "firmware"))
+            i = 3;
+        else if (!strcmp(type, "platform"))
+            i = 2;
+        else
+            i = 1;
+        /* equal types: the device this board was built for wins */
+        return i * 2 + !strcmp(name, LIGHT_BACKLIGHT_DEFAULT);
+    }
+
+    for (count = 0; desc->names[count]; count++)
+        ;
+    for (i = 0; i < count; i++) {
+        if (!strcmp(name, desc->names[i]))
+            return (count - i) * 2 + 1;
+        if (strstr(name, desc->names[i]))
+            return (count - i) * 2;
+    }
+
+    return 0;
+}
+
+static const char *const light_channel_names[LIGHT_CHANNEL_MAX] = {
+    "red", "green", "blue", "white",
+};
+
+/*
+ * Which colour channel the LED called name drives, going by the
+ * "devicename:colour:function" convention; ranked higher when the
+ * function (or device) looks like a notification LED. 0 if none.
+ */
+static int lights_channel_rank(const char *name, int *channel)
+{
+    char buf[NAME_MAX + 1];
+    char *field, *save;
+    int i, rank = 0;
+
+    snprintf(buf, sizeof(buf), "%s", name);
+    for (field = strtok_r(buf, ":", &save); field;
+         field = strtok_r(NULL, ":", &save)) {
+        for (i = 0; i < LIGHT_CHANNEL_MAX; i++) {
+            if (!strcmp(field, light_channel_names[i])) {
+                *channel = i;
+                rank = 1;
+            }
+        }
+    }
+    if (rank && (strstr(name, "notification") || strstr(name, "indicator")))
+        rank = 2;
+
+    return rank;
+}
+
+/*
+ * Keep the LIGHT_PANEL_MAX best ranked backlights in light_panel_locations,
+ * in the order lights_scan_class() ranks them: the first is the primary.
+ */
+static void lights_panel_add(const char *name, int rank)
+{
+    struct light_location *seen = light_panel_locations;
+    int i;
+
+    for (i = LIGHT_PANEL_MAX - 1; i >= 0; i--) {
+        if (seen[i].rank && (seen[i].rank > rank || (seen[i].rank == rank
+                             && strcmp(seen[i].name, name) < 0)))
+            break;
+        if (i < LIGHT_PANEL_MAX - 1)
+            seen[i + 1] = seen[i];
+    }
+    if (++i >= LIGHT_PANEL_MAX)
+        return;
+    seen[i].rank = rank;
+    snprintf(seen[i].name, sizeof(seen[i].name), "%s", name);
+}
+
+static void lights_scan_class(const char *class_name)
+{
+    struct light_location *loc;
+    const struct light_desc *desc;
+    char class_dir[PATH_MAX], dir[PATH_MAX];
+    struct dirent *entry;
+    unsigned int i;
+    DIR *d;
+    int rank, channel;
+
+    if (lights_path(class_dir, sizeof(class_dir), "%s/%s", lights_sysfs_root,
+                    class_name))
+        return;
+    d = opendir(class_dir);
+    if (!d)
+        return;
+
+    while ((entry = readdir(d))) {
+        /* a device whose attributes we couldn't name is no use either */
+        if (entry->d_name[0] == '.'
+            || lights_path(dir, sizeof(dir), "%s/%s/max_brightness",
+                           class_dir, entry->d_name))
+            continue;
+        lights_path(dir, sizeof(dir), "%s/%s", class_dir, entry->d_name);
+        for (i = 0; i < LIGHT_DESC_COUNT; i++) {
+            desc = &light_descs[i];
+            if (strcmp(desc->class_name, class_name))
+                continue;
+            loc = &light_locations[desc->type];
+            rank = lights_rank(desc, dir, entry->d_name);
+            if (desc->type == LIGHT_TYPE_BACKLIGHT && rank)
+                lights_panel_add(entry->d_name, rank);
+            /* readdir order is arbitrary: break ties by name */
+            if (rank > loc->rank || (rank && rank == loc->rank
+                                     && strcmp(entry->d_name, loc->name) < 0)) {
+                loc->rank = rank;
+                snprintf(loc->name, sizeof(loc->name), "%s", entry->d_name);
+            }
+        }
+
+        if (strcmp(class_name, "leds"))
+            continue;
+        rank = lights_channel_rank(entry->d_name, &channel);
+        if (!rank)
+            continue;
+        loc = &light_channel_locations[channel];
+        if (rank > loc->rank || (rank == loc->rank
+                                 && strcmp(entry->d_name, loc->name) < 0)) {
+            loc->rank = rank;
+            snprintf(loc->name, sizeof(loc->name), "%s", entry->d_name);
+        }
+    }
+
+    closedir(d);
+}
+
+/* the attributes of class device dir; fails on "" (dir didn't fit) */
+static int lights_location_set(struct light_location *loc, const char *dir)
+{
+    if (!dir[0]
+        || lights_path(loc->path, sizeof(loc->path), "%s/brightness", dir)
+        || lights_path(loc->max_path, sizeof(loc->max_path),
+                       "%s/max_brightness", dir))
+        return -ENAMETOOLONG;
+
+    return 0;
+}
+
+/* runs once, at the first open_lights() */
+static void lights_discover(void)
+{
+    const struct light_desc *desc;
+    struct light_location *loc;
+    char dir[PATH_MAX];
+    unsigned int i;
+
+    property_get(LIGHT_PROP_SYSFS_ROOT, lights_sysfs_root, LIGHT_PATH_BASE);
+
+    lights_scan_class("backlight");
+    lights_scan_class("leds");
+
+    for (i = 0; i < LIGHT_DESC_COUNT; i++) {
+        desc = &light_descs[i];
+        loc = &light_locations[desc->type];
+        if (loc->rank)
+            lights_path(dir, sizeof(dir), "%s/%s/%s", lights_sysfs_root,
+                        desc->class_name, loc->name);
+        else
+            lights_path(dir, sizeof(dir), "%s/%s", lights_sysfs_root,
+                        desc->legacy_dir);
+        if (lights_location_set(loc, dir)) {
+            LIGHTS_LOGE("%s: path too long under %s\n", desc->id,
+                        lights_sysfs_root);
+            continue;
+        }
+        LIGHTS_LOGD("%s: %s%s\n", desc->id, dir, loc->rank ? "" : " (default)");
+    }
+
+    for (i = 0; i < LIGHT_CHANNEL_MAX; i++) {
+        loc = &light_channel_locations[i];
+        if (!loc->rank)
+            continue;
+        lights_path(dir, sizeof(dir), "%s/leds/%s", lights_sysfs_root,
+                    loc->name);
+        if (lights_location_set(loc, dir)) {
+            loc->rank = 0;
+            continue;
+        }
+        LIGHTS_LOGD("%s channel: %s\n", light_channel_names[i], dir);
+    }
+
+    for (i = 1; i < LIGHT_PANEL_MAX; i++) {
+        loc = &light_panel_locations[i];
+        if (!loc->rank)
+            break;
+        lights_path(dir, sizeof(dir), "%s/backlight/%s", lights_sysfs_root,
+                    loc->name);
+        if (lights_location_set(loc, dir)) {
+            loc->rank = 0;
+            break;
+        }
+        LIGHTS_LOGD("backlight%u: %s\n", i, dir);
+    }
+}
+
+/* the extra panels, when lights.backlight.route sends anything there */
+static void lights_open_panels(struct lights_ctx *ctx)
+{
+    char value[PROPERTY_VALUE_MAX];
+    struct light_location *loc;
+    struct light_panel *panel;
+    char *field, *save;
+    int i;
+
+    property_get(LIGHT_PROP_BACKLIGHT_ROUTE, value, "primary");
+    if (!strcmp(value, "mirror"))
+        ctx->route = LIGHT_ROUTE_MIRROR;
+    else if (!strcmp(value, "scale"))
+        ctx->route = LIGHT_ROUTE_SCALE;
+    else
+        ctx->route = LIGHT_ROUTE_PRIMARY;
+
+    property_get(LIGHT_PROP_BACKLIGHT_SCALE, value, "");
+    field = strtok_r(value, ",", &save);
+    for (i = 0; i < LIGHT_PANEL_MAX; i++) {
+        ctx->scale[i] = field ? atoi(field) : 1000;
+        if (ctx->scale[i] < 0 || ctx->scale[i] > 1000)
+            ctx->scale[i] = 1000;
+        if (field)
+            field = strtok_r(NULL, ",", &save);
     }
 
-    LOGD("opened %s, fd = %d\n", path, *pfd);
+    if (ctx->route == LIGHT_ROUTE_PRIMARY || ctx->nr_panels)
+        return;
+
+    for (i = 1; i < LIGHT_PANEL_MAX; i++) {
+        loc = &light_panel_locations[i];
+        if (!loc->rank)
+            break;
+        panel = &ctx->panels[ctx->nr_panels];
+        snprintf(panel->id, sizeof(panel->id), "backlight%d", i);
+        panel->node.id = panel->id;
+        if (lights_node_open(&panel->node, loc->path, loc->max_path))
+            continue;
+        panel->node.coalesce = 1;
+        panel->writer.name = panel->id;
+        panel->writer.pending = -1;
+        if (lights_init_writer(&panel->writer, &panel->node)) {
+            close(panel->node.fd);
+            panel->node.fd = -1;
+            continue;
+        }
+        ctx->nr_panels++;
+    }
+}
+
+/*
+ * Open the colour channels of an RGB LED; succeeds only with at least
+ * red, green and blue, anything else is left to the single-node path.
+ */
+static int lights_open_rgb(struct light_rgb *rgb)
+{
+    char value[PROPERTY_VALUE_MAX];
+    struct light_location *loc;
+    struct light_node *node;
+    int i;
+
+    if (rgb->present)
+        return 0;
+
+    for (i = 0; i < LIGHT_CHANNEL_MAX; i++) {
+        loc = &light_channel_locations[i];
+        node = &rgb->channels[i];
+        node->id = light_channel_names[i];
+        node->coalesce = 1;
+        if (!loc->rank || lights_node_open(node, loc->path, loc->max_path)) {
+            node->fd = -1;
+            node->path = NULL;	/* absent, dump skips it */
+            if (i != LIGHT_CHANNEL_WHITE)
+                goto fail;
+        }
+        rgb->balance[i] = 1000;
+    }
+
+    property_get(LIGHT_PROP_RGB_BALANCE, value, "");
+    sscanf(value, "%d,%d,%d,%d", &rgb->balance[LIGHT_CHANNEL_RED],
+           &rgb->balance[LIGHT_CHANNEL_GREEN], &rgb->balance[LIGHT_CHANNEL_BLUE],
+           &rgb->balance[LIGHT_CHANNEL_WHITE]);
+    for (i = 0; i < LIGHT_CHANNEL_MAX; i++) {
+        if (rgb->balance[i] < 0 || rgb->balance[i] > 1000)
+            rgb->balance[i] = 1000;
+    }
+
+    pthread_mutex_init(&rgb->lock, NULL);
+    rgb->present = 1;
+    return 0;
+
+fail:
+    while (i-- > 0) {
+        if (rgb->channels[i].fd >= 0)
+            close(rgb->channels[i].fd);
+        rgb->channels[i].fd = -1;
+        rgb->channels[i].path = NULL;
+    }
+    return -ENODEV;
+}
 
-    dev->set_light = set_light;
-    lights_init_info(info, *pfd);
+static int lights_is_write_through(const char *id)
+{
+    char value[PROPERTY_VALUE_MAX];
+    char *field, *save;
+
+    property_get(LIGHT_PROP_WRITE_THROUGH, value, LIGHT_WRITE_THROUGH_DEFAULT);
+    for (field = strtok_r(value, ",", &save); field;
+         field = strtok_r(NULL, ",", &save)) {
+        if (!strcmp(field, id))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int lights_open_node(struct lights_ctx *ctx, struct lights_device *dev,
+                            const struct light_desc *desc)
+{
+    struct light_node *node = &ctx->nodes[desc->type];
+    struct light_location *loc = &light_locations[desc->type];
+    int ret;
+
+    pthread_once(&light_discover_once, lights_discover);
+
+    node->id = desc->id;
+    ctx->write_through[desc->type] = lights_is_write_through(desc->id);
+    if (desc->rgb && !lights_open_rgb(&ctx->rgb)) {
+        /* colour LEDs take the place of the single node */
+        ctx->blinks[desc->type].rgb = &ctx->rgb;
+    } else if (node->fd < 0) {
+        /*
+         * Opened once: other devices of this light may be writing from
+         * the node (and its table) on other threads right now.
+         */
+        ret = lights_node_open(node, loc->path, loc->max_path);
+        if (ret < 0)
+            return ret;
+        node->coalesce = desc->coalesce;
+    }
+
+    dev->desc = desc;
+    dev->ext.common.set_light = desc->set_light;
+    dev->ext.set_light_ramp = desc->set_light_ramp;
+    dev->ext.set_light_level = desc->set_light_level;
+    dev->ext.dump = lights_dump_dev;
+    dev->ext.set_power_state = lights_set_power_state;
+    dev->ext.set_lights = lights_set_lights;
+    if (desc->blink)
+        dev->ext.set_light_pattern = lights_set_light_pattern;
+
+    /* without its event loop an auto-off light is written directly */
+    if (desc->auto_off && !ctx->infos[desc->type]
+        && !lights_init_info(desc->auto_off, node))
+        ctx->infos[desc->type] = desc->auto_off;
+
+    if (desc->type == LIGHT_TYPE_BACKLIGHT)
+        lights_open_panels(ctx);
+
+#ifdef LIGHT_BACKLIGHT_ASYNC
+    /* falls back to synchronous writes if the thread can't start */
+    if (desc->type == LIGHT_TYPE_BACKLIGHT)
+        lights_get_writer(ctx);
+#endif
 
     return 0;
 }
@@ -478,6 +3737,7 @@ static int lights_open_node(struct lights_ctx *ctx, struct light_device_t *dev,
 static struct lights_ctx *lights_init_context(void)
 {
     struct lights_ctx *ctx;
+    int i;
 
     ctx = malloc(sizeof(struct lights_ctx));
     if (!ctx)
@@ -485,12 +3745,15 @@ static struct lights_ctx *lights_init_context(void)
 
     memset(ctx, 0, sizeof(*ctx));
 
-    ctx->fds.backlight = -1;
-    ctx->fds.keyboard = -1;
-    ctx->fds.buttons = -1;
-    ctx->fds.battery = -1;
-    ctx->fds.notifications = -1;
-    ctx->fds.attention = -1;
+    for (i = 0; i < LIGHT_TYPE_MAX; i++) {
+        ctx->nodes[i].fd = -1;
+        ctx->blinks[i].node = &ctx->nodes[i];
+        ctx->blinks[i].index = -1;
+    }
+    for (i = 0; i < LIGHT_CHANNEL_MAX; i++)
+        ctx->rgb.channels[i].fd = -1;
+    ctx->power_state = LIGHT_POWER_ON;
+    pthread_mutex_init(&ctx->power_lock, NULL);
 
     return ctx;
 }
@@ -508,10 +3771,15 @@ static struct lights_ctx *lights_init_context(void)
 static int open_lights(const struct hw_module_t *module, const char *id,
                        struct hw_device_t **device)
 {
-    struct light_device_t *dev;
+    const struct light_desc *desc;
+    struct lights_device *dev;
     int ret;
 
-    dev = malloc(sizeof(struct light_device_t));
+    desc = lights_find_desc(id);
+    if (!desc)
+        return -EINVAL;
+
+    dev = malloc(sizeof(struct lights_device));
     if (!dev)
 	    return -ENOMEM;
 
@@ -525,16 +3793,17 @@ static int open_lights(const struct hw_module_t *module, const char *id,
 	}
     }
 
-    ret = lights_open_node(context, dev, id);
+    ret = lights_open_node(context, dev, desc);
     if (ret < 0) {
         free(dev);
         return ret;
     }
 
-    dev->common.tag = HARDWARE_DEVICE_TAG;
-    dev->common.version = 0;
-    dev->common.module = (struct hw_module_t *)module;
-    dev->common.close = (int (*)(struct hw_device_t* device))close_lights_dev;
+    dev->ext.common.common.tag = HARDWARE_DEVICE_TAG;
+    dev->ext.common.common.version = LIGHT_DEVICE_EXT_VERSION;
+    dev->ext.common.common.module = (struct hw_module_t *)module;
+    dev->ext.common.common.close =
+            (int (*)(struct hw_device_t* device))close_lights_dev;
 
     *device = (struct hw_device_t *)dev;
     return 0;
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2008, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIGHTS_EXT_H
+#define LIGHTS_EXT_H
+
+#include <hardware/lights.h>
+
+/*
+ * Extensions to the lights HAL device. Devices opened from this module
+ * are struct light_device_ext_t; clients that know about it check
+ * common.common.version before using the extra entry points, everyone
+ * else keeps using them as a plain struct light_device_t.
+ */
+#define LIGHT_DEVICE_EXT_VERSION    6   /* 2: dump, 3: set_light_level,
+                                           4: set_power_state,
+                                           5: set_lights,
+                                           6: set_light_pattern */
+
+/* brightness curves a ramp interpolates along */
+#define LIGHT_CURVE_LINEAR          0
+#define LIGHT_CURVE_GAMMA           1   /* gamma 2.2 */
+#define LIGHT_CURVE_CIE             2   /* CIE 1931 lightness */
+
+/* set_power_state() */
+#define LIGHT_POWER_ON              0
+#define LIGHT_POWER_DISPLAY_OFF     1
+#define LIGHT_POWER_SUSPEND         2
+
+/* full scale of set_light_level(); 8-bit brightness b is level b * 257 */
+#define LIGHT_LEVEL_MAX             0xffff
+
+/* one light of a set_lights() batch */
+struct light_batch_entry_t {
+    const char *id;                     /* LIGHT_ID_* */
+    struct light_state_t state;
+};
+
+#define LIGHT_BATCH_MAX             16
+
+/*
+ * One period of set_light_pattern(): the LED ramps up from off over
+ * rise_ms, holds for on_ms, ramps down over fall_ms and stays off for
+ * off_ms. Ramps are linear in hardware units; 0 makes them a step, so a
+ * plain blink is {0, on, 0, off}.
+ */
+struct light_pattern_t {
+    int rise_ms;
+    int on_ms;
+    int fall_ms;
+    int off_ms;
+    int repeat;                         /* periods, then off; 0: forever */
+};
+
+struct light_device_ext_t {
+    struct light_device_t common;
+
+    /*
+     * Fade to the brightness of state over duration_ms along curve,
+     * stepping at the panel's native resolution from a HAL thread.
+     * Returns as soon as the ramp is queued; a later set_light() or
+     * set_light_ramp() supersedes it. NULL for lights without ramping.
+     */
+    int (*set_light_ramp)(struct light_device_ext_t *dev,
+                          struct light_state_t const *state,
+                          int duration_ms, int curve);
+
+    /*
+     * Write the counters and write-latency histograms of every light
+     * opened from this module to fd as text, without pausing the HAL.
+     */
+    int (*dump)(struct light_device_ext_t *dev, int fd);
+
+    /*
+     * set_light_ramp() with a 16-bit level instead of a color: level runs
+     * 0..LIGHT_LEVEL_MAX and goes through the light's brightness curve
+     * straight onto the hardware range, so panels with thousands of steps
+     * get all of them. duration_ms 0 jumps. NULL where set_light_ramp is.
+     */
+    int (*set_light_level)(struct light_device_ext_t *dev, unsigned int level,
+                           int duration_ms, int curve);
+
+    /*
+     * Tell the HAL the display is off or the system is going to suspend
+     * before the backlight says so. Other than ON, updates to lights not
+     * listed in lights.write_through are cached and only the last one is
+     * written on the way back to ON; a non-zero backlight also means ON.
+     */
+    int (*set_power_state)(struct light_device_ext_t *dev, int state);
+
+    /*
+     * Set several lights at once, each of which must have been opened
+     * from this module (dev can be any of them). Nothing is written if
+     * an id is unknown (-EINVAL) or not open (-ENODEV). Otherwise the
+     * batch is applied in one pass, waking each HAL thread at most once.
+     *
+     * Only the LEDs the HAL writes itself are applied atomically: no
+     * other set_light(), set_light_pattern(), power state change or blink
+     * step sees some of them done and others not. The rest is not part
+     * of that: the backlight is applied on its own before the LEDs (and,
+     * with an asynchronous backlight writer, lands after the call
+     * returns), and lights with auto off are handed to the event loop,
+     * which writes them after the call returns. Lights deferred while
+     * the display is off are cached as with set_light().
+     */
+    int (*set_lights)(struct light_device_ext_t *dev,
+                      struct light_batch_entry_t const *entries, int count);
+
+    /*
+     * Breathe or pulse the light at the brightness (and color) of state,
+     * ignoring its flash fields. The pattern runs in the LED's kernel
+     * trigger where the driver has one and on a HAL thread otherwise; a
+     * later set_light() or set_light_pattern() replaces it. NULL for
+     * lights that can't flash.
+     */
+    int (*set_light_pattern)(struct light_device_ext_t *dev,
+                             struct light_state_t const *state,
+                             struct light_pattern_t const *pattern);
+};
+
+#endif /* LIGHTS_EXT_H */